@@ -17,36 +17,31 @@
  */
 
 #include "bank.h"
-#include "file.h"
 #include "resource.h"
 
 
-Bank::Bank(const char *dataDir)
-	: _dataDir(dataDir) {
-}
-
-bool Bank::read(const MemEntry *me, uint8_t *buf) {
+/*
+	src points to the resource in the mapped bank file. Packed resources are
+	unpacked from there, they are not copied to buf first.
+*/
+bool Bank::read(const MemEntry *me, const uint8_t *src, uint8_t *buf) {
 
 	bool ret = false;
-	char bankName[10];
-	sprintf(bankName, "bank%02x", me->bankId);
-	File f;
-
-	if (!f.open(bankName, _dataDir))
-		error("Bank::read() unable to open '%s'", bankName);
-
-	
-	f.seek(me->bankOffset);
 
 	// Depending if the resource is packed or not we
 	// can read directly or unpack it.
 	if (me->packedSize == me->size) {
-		f.read(buf, me->packedSize);
+		memcpy(buf, src, me->packedSize);
 		ret = true;
 	} else {
-		f.read(buf, me->packedSize);
+		// The stream ends with its unpacked size. unpack() writes that many
+		// bytes, buf only holds me->size.
+		if (READ_BE_UINT32(src + me->packedSize - 4) != me->size) {
+			return false;
+		}
+		_srcBuf = src;
 		_startBuf = buf;
-		_iBuf = buf + me->packedSize - 4;
+		_iBuf = src + me->packedSize - 4;
 		ret = unpack();
 	}
 	
@@ -58,7 +53,7 @@ void Bank::decUnk1(uint8_t numChunks, uint8_t addCount) {
 	debug(DBG_BANK, "Bank::decUnk1(%d, %d) count=%d", numChunks, addCount, count);
 	_unpCtx.datasize -= count;
 	while (count--) {
-		assert(_oBuf >= _iBuf && _oBuf >= _startBuf);
+		assert(_oBuf >= _startBuf);
 		*_oBuf = (uint8_t)getCode(8);
 		--_oBuf;
 	}
@@ -73,7 +68,7 @@ void Bank::decUnk2(uint8_t numChunks) {
 	debug(DBG_BANK, "Bank::decUnk2(%d) i=%d count=%d", numChunks, i, count);
 	_unpCtx.datasize -= count;
 	while (count--) {
-		assert(_oBuf >= _iBuf && _oBuf >= _startBuf);
+		assert(_oBuf >= _startBuf);
 		*_oBuf = *(_oBuf + i);
 		--_oBuf;
 	}
@@ -82,7 +77,7 @@ void Bank::decUnk2(uint8_t numChunks) {
 /*
 	Most resource in the banks are compacted.
 */
-bool Bank::unpack() {
+bool Bank::unpackReference() {
 	_unpCtx.size = 0;
 	_unpCtx.datasize = READ_BE_UINT32(_iBuf); _iBuf -= 4;
 	_oBuf = _startBuf + _unpCtx.datasize - 1;
@@ -129,7 +124,7 @@ uint16_t Bank::getCode(uint8_t numChunks) {
 bool Bank::nextChunk() {
 	bool CF = rcr(false);
 	if (_unpCtx.chk == 0) {
-		assert(_iBuf >= _startBuf);
+		assert(_iBuf >= _srcBuf);
 		_unpCtx.chk = READ_BE_UINT32(_iBuf); _iBuf -= 4;
 		_unpCtx.crc ^= _unpCtx.chk;
 		CF = rcr(true);
@@ -143,3 +138,137 @@ bool Bank::rcr(bool CF) {
 	if (CF) _unpCtx.chk |= 0x80000000;
 	return rCF;
 }
+
+static inline uint32_t reverseBits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+	return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+}
+
+/*
+	The packed stream is read backwards, 32 bits at a time, and each word is
+	consumed from its least significant bit. The first word only holds the
+	bits below its highest set bit. Codes are made of the bits in the order
+	they come out, the first one being the most significant.
+
+	BitReader keeps up to 64 of those bits, bit reversed so that the next one
+	is bit 63: a code of n bits is then the top n bits of the buffer.
+*/
+struct BitReader {
+	uint64_t bits;
+	int count;
+	const uint8_t *next; // next word to load, going down to start
+	const uint8_t *start;
+	uint32_t crc;
+
+	bool refill(int n) {
+		while (count <= 32 && next >= start) {
+			const uint32_t w = READ_BE_UINT32(next);
+			next -= 4;
+			crc ^= w;
+			bits |= (uint64_t)reverseBits(w) << (32 - count);
+			count += 32;
+		}
+		return count >= n;
+	}
+
+	// n is 1 to 32, the caller made sure count >= n.
+	uint32_t get(int n) {
+		const uint32_t c = (uint32_t)(bits >> (64 - n));
+		bits <<= n;
+		count -= n;
+		return c;
+	}
+};
+
+#define NEED_BITS(n) if (br.count < (n) && !br.refill(n)) return false
+
+/*
+	Same format as unpackReference(), decoded a code at a time instead of a bit
+	at a time. Back references that do not overlap the bytes they produce are
+	copied with memcpy, the others are runs repeating a pattern and still go
+	byte by byte, from the end as the reference does.
+*/
+bool Bank::unpack() {
+	const uint8_t *p = _iBuf;
+	int32_t datasize = READ_BE_UINT32(p); p -= 4;
+	const uint32_t crc = READ_BE_UINT32(p); p -= 4;
+	const uint32_t chk = READ_BE_UINT32(p); p -= 4;
+
+	BitReader br;
+	br.next = p;
+	br.start = _srcBuf;
+	br.crc = crc ^ chk;
+	br.count = 0;
+	while (br.count < 31 && (chk >> (br.count + 1)) != 0) {
+		++br.count;
+	}
+	br.bits = br.count == 0 ? 0 : (uint64_t)(reverseBits(chk) & (0xFFFFFFFF << (32 - br.count))) << 32;
+
+	uint8_t *const dstEnd = _startBuf + datasize;
+	uint8_t *dst = dstEnd; // one past the next byte to write
+	while (datasize > 0) {
+		int len;
+		uint32_t offset;
+		NEED_BITS(3);
+		const uint32_t op = (uint32_t)(br.bits >> 61);
+		if (op < 2) { // 00: up to 8 bytes
+			br.get(2);
+			NEED_BITS(3);
+			len = br.get(3) + 1;
+			offset = 0;
+		} else if (op < 4) { // 01: 2 bytes, 8 bits offset
+			br.get(2);
+			NEED_BITS(8);
+			len = 2;
+			offset = br.get(8);
+		} else if (op == 7) { // 111: 9 to 264 bytes
+			br.get(3);
+			NEED_BITS(8);
+			len = br.get(8) + 9;
+			offset = 0;
+		} else if (op < 6) { // 100, 101: 3 or 4 bytes, 9 or 10 bits offset
+			br.get(3);
+			const int n = op - 4;
+			NEED_BITS(n + 9);
+			len = n + 3;
+			offset = br.get(n + 9);
+		} else { // 110: 1 to 256 bytes, 12 bits offset
+			br.get(3);
+			NEED_BITS(8 + 12);
+			len = br.get(8) + 1;
+			offset = br.get(12);
+		}
+		if (len > datasize) {
+			return false;
+		}
+		datasize -= len;
+		dst -= len;
+		if (op < 2 || op == 7) {
+			for (int i = len - 1; i >= 0; --i) {
+				NEED_BITS(8);
+				dst[i] = (uint8_t)br.get(8);
+			}
+		} else {
+			if (offset > (uint32_t)(dstEnd - dst - len)) {
+				return false;
+			}
+			if (offset >= (uint32_t)len) {
+				memcpy(dst, dst + offset, len);
+			} else {
+				for (int i = len - 1; i >= 0; --i) {
+					dst[i] = dst[i + offset];
+				}
+			}
+		}
+	}
+
+	// The reference only loads a word when it needs its first bit, the
+	// whole words left in the buffer were never part of its crc.
+	uint32_t rest = br.crc;
+	for (int i = br.count / 32; i > 0; --i) {
+		rest ^= READ_BE_UINT32(br.next + i * 4);
+	}
+	return rest == 0;
+}
@@ -32,15 +32,17 @@ struct UnpackContext {
 
 struct Bank {
 	UnpackContext _unpCtx;
-	const char *_dataDir;
-	uint8_t *_iBuf, *_oBuf, *_startBuf;
+	const uint8_t *_iBuf, *_srcBuf;
+	uint8_t *_oBuf, *_startBuf;
 
-	Bank(const char *dataDir);
+	bool read(const MemEntry *me, const uint8_t *src, uint8_t *buf);
+	bool unpack();
 
-	bool read(const MemEntry *me, uint8_t *buf);
+	// The original decoder, one bit at a time. unpack() must give the same
+	// bytes and the same crc result, --bench=unpack checks it.
+	bool unpackReference();
 	void decUnk1(uint8_t numChunks, uint8_t addCount);
 	void decUnk2(uint8_t numChunks);
-	bool unpack();
 	uint16_t getCode(uint8_t numChunks);
 	bool nextChunk();
 	bool rcr(bool CF);
@@ -0,0 +1,434 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <chrono>
+#include <thread>
+#include "benchmark.h"
+#include "engine.h"
+#include "sysNull.h"
+#include "sysTurbo.h"
+#include "vm.h"
+#include "resource.h"
+#include "bank.h"
+#include "mapping.h"
+#include "simd.h"
+
+extern System *System_Null_create();
+
+static double elapsedSeconds(const std::chrono::steady_clock::time_point &start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+	A thread mixing the opcodes that dominate game scripts: variable arithmetic,
+	conditional jumps and a call/return pair. Each run executes
+	1 + BENCH_VM_LOOPS * 14 + 1 instructions before hitting the break.
+*/
+#define BENCH_VM_LOOPS 1000
+#define BENCH_VM_OPS_PER_RUN (1 + BENCH_VM_LOOPS * 14 + 1)
+
+static const uint8_t benchVmBytecode[] = {
+	/* 0x00 */ 0x00, 0x00, BENCH_VM_LOOPS >> 8, BENCH_VM_LOOPS & 0xFF, // VAR(0) = BENCH_VM_LOOPS
+	/* 0x04 */ 0x00, 0x01, 0x00, 0x07,       // loop: VAR(1) = 7
+	/* 0x08 */ 0x02, 0x02, 0x01,             // VAR(2) += VAR(1)
+	/* 0x0B */ 0x03, 0x03, 0x00, 0x03,       // VAR(3) += 3
+	/* 0x0F */ 0x13, 0x04, 0x01,             // VAR(4) -= VAR(1)
+	/* 0x12 */ 0x14, 0x02, 0x7F, 0xFF,       // VAR(2) &= 0x7FFF
+	/* 0x16 */ 0x15, 0x03, 0x00, 0x10,       // VAR(3) |= 0x10
+	/* 0x1A */ 0x16, 0x05, 0x00, 0x01,       // VAR(5) <<= 1
+	/* 0x1E */ 0x17, 0x05, 0x00, 0x01,       // VAR(5) >>= 1
+	/* 0x22 */ 0x01, 0x06, 0x02,             // VAR(6) = VAR(2)
+	/* 0x25 */ 0x0A, 0x00, 0x01, 0x08, 0x00, 0x2E, // jmpIf(VAR(1) == 8, @2E), never taken
+	/* 0x2B */ 0x04, 0x00, 0x36,             // call @36
+	/* 0x2E */ 0x09, 0x00, 0x00, 0x04,       // if (--VAR(0) != 0) jmp @04
+	/* 0x32 */ 0x06,                         // break
+	/* 0x33 */ 0x07, 0x00, 0x00,             // jmp @00
+	/* 0x36 */ 0x03, 0x07, 0x00, 0x01,       // VAR(7) += 1
+	/* 0x3A */ 0x05                          // ret
+};
+
+typedef void (VirtualMachine::*ExecuteCore)();
+
+static void benchVmCore(VirtualMachine *vm, ExecuteCore core, const char *name) {
+	const int runs = 2000;
+
+	memset(vm->vmVariables, 0, sizeof(vm->vmVariables));
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < runs; ++i) {
+		vm->_nextInsn = vm->translate(0);
+		vm->_stackPtr = 0;
+		vm->gotoNextThread = false;
+		(vm->*core)();
+	}
+	double t = elapsedSeconds(start);
+
+	uint64_t ops = (uint64_t)runs * BENCH_VM_OPS_PER_RUN;
+	printf("%-10s %10.0f Kops/s  (%llu ops in %.3f s, VAR(7)=%d)\n", name, ops / t / 1000., (unsigned long long)ops, t, vm->vmVariables[7]);
+}
+
+void bench_vmDispatch() {
+	uint8_t *bytecode = (uint8_t *)calloc(1, 0x10000);
+	memcpy(bytecode, benchVmBytecode, sizeof(benchVmBytecode));
+
+	// Arithmetic and jumps only touch the variables and segBytecode,
+	// the VM can run without a System, Video or Mixer behind it.
+	Resource *res = new Resource(NULL, ".");
+	res->segBytecode = bytecode;
+	VirtualMachine *vm = new VirtualMachine(NULL, res, NULL, NULL, NULL);
+	vm->resetInstructionCache();
+
+	printf("VM dispatch benchmark, %d instructions per thread run\n", BENCH_VM_OPS_PER_RUN);
+	benchVmCore(vm, &VirtualMachine::executeThreadTable, "table");
+#ifdef VM_THREADED_DISPATCH
+	benchVmCore(vm, &VirtualMachine::executeThreadThreaded, "threaded");
+#else
+	printf("threaded   not built (configure with RAW_THREADED_DISPATCH=ON)\n");
+#endif
+
+	delete vm;
+	delete res;
+	free(bytecode);
+}
+
+/*
+	Runs independent engines on as many threads, each with its own headless
+	turbo System, and reports the aggregate frame rate as threads are added.
+	Needs the game data.
+*/
+#define BENCH_ENGINE_FRAMES 3000
+
+static void benchEngineThread(const char *dataPath, double *seconds) {
+	System *stub = System_Null_create();
+	TurboStub *sys = new TurboStub(stub);
+	Engine *e = new Engine(sys, dataPath, ".");
+	e->init();
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < BENCH_ENGINE_FRAMES && e->runFrame(); ++i) {
+	}
+	*seconds = elapsedSeconds(start);
+
+	delete e;
+	delete sys;
+	delete stub;
+}
+
+void bench_engines(const char *dataPath) {
+	int maxThreads = std::thread::hardware_concurrency();
+	if (maxThreads < 1) {
+		maxThreads = 1;
+	}
+
+	printf("Engine scaling benchmark, %d frames per engine\n", BENCH_ENGINE_FRAMES);
+	double singleRate = 0;
+	for (int n = 1; n <= maxThreads; n = (n * 2 > maxThreads && n != maxThreads) ? maxThreads : n * 2) {
+		std::thread *threads = new std::thread[n];
+		double *seconds = new double[n];
+		for (int i = 0; i < n; ++i) {
+			threads[i] = std::thread(benchEngineThread, dataPath, &seconds[i]);
+		}
+		double slowest = 0;
+		for (int i = 0; i < n; ++i) {
+			threads[i].join();
+			if (seconds[i] > slowest) {
+				slowest = seconds[i];
+			}
+		}
+		double rate = (double)n * BENCH_ENGINE_FRAMES / slowest;
+		if (n == 1) {
+			singleRate = rate;
+		}
+		printf("%3d engines %10.0f frames/s  (x%.2f, %.0f%% efficiency)\n", n, rate, rate / singleRate, rate / singleRate / n * 100);
+		delete[] threads;
+		delete[] seconds;
+	}
+}
+
+/*
+	Span kernels on the spans a 4bpp page sees: random offsets and widths up to
+	a full line (160 bytes). Each kernel set is checked against the byte at a
+	time reference before being timed, the reference is timed last. planar reads a span from each of four 8000 byte planes,
+	as copyPage() does with a whole POLY_ANIM bitmap.
+*/
+#define BENCH_SPAN_COUNT 4096
+#define BENCH_SPAN_PASSES 500
+#define BENCH_SPAN_PAGE_SIZE 32000
+#define BENCH_SPAN_PLANE_SIZE (BENCH_SPAN_PAGE_SIZE / 4)
+
+struct BenchSpan {
+	uint16_t offset;
+	uint8_t len;
+	uint8_t value;
+};
+
+enum {
+	BENCH_SPAN_FILL,
+	BENCH_SPAN_COPY,
+	BENCH_SPAN_BLEND,
+	BENCH_SPAN_EXPAND,
+	BENCH_SPAN_PLANAR,
+	BENCH_SPAN_NUM_OPS
+};
+
+static uint32_t benchSpanRun(const SpanKernels *sk, int op, const BenchSpan *spans, uint8_t *dst, const uint8_t *src, int passes) {
+	// expand writes pixels, not page bytes.
+	static uint32_t rgb[BENCH_SPAN_PAGE_SIZE];
+	static PixelLut lut;
+	// planar writes up to 8 pixels per plane byte, from full bytes.
+	static uint8_t planes[BENCH_SPAN_PAGE_SIZE];
+	static uint8_t chunky[BENCH_SPAN_PAGE_SIZE * 2];
+	if (op == BENCH_SPAN_PLANAR) {
+		for (int i = 0; i < BENCH_SPAN_PAGE_SIZE; ++i) {
+			planes[i] = i * 7 + (i >> 5);
+		}
+		memset(chunky, 0, sizeof(chunky));
+	}
+	if (op == BENCH_SPAN_EXPAND) {
+		uint32_t colors[16];
+		for (int i = 0; i < 16; ++i) {
+			colors[i] = 0xFF000000 | (i * 0x0F0D0B);
+		}
+		lut.setColors(colors);
+	}
+
+	memset(dst, 0x5A, BENCH_SPAN_PAGE_SIZE);
+	for (int pass = 0; pass < passes; ++pass) {
+		for (int i = 0; i < BENCH_SPAN_COUNT; ++i) {
+			const BenchSpan *s = &spans[i];
+			switch (op) {
+			case BENCH_SPAN_FILL:
+				sk->fill(dst + s->offset, s->value, s->len);
+				break;
+			case BENCH_SPAN_COPY:
+				sk->copy(dst + s->offset, src + s->offset, s->len);
+				break;
+			case BENCH_SPAN_BLEND:
+				sk->blend(dst + s->offset, 0x77, 0x88, s->len);
+				break;
+			case BENCH_SPAN_EXPAND:
+				sk->expand(rgb + (s->offset & ~1) / 2, src + s->offset, s->len, &lut);
+				break;
+			case BENCH_SPAN_PLANAR: {
+					const int offset = s->offset % (BENCH_SPAN_PLANE_SIZE - 160);
+					sk->planar(chunky + offset * (sizeof(chunky) / BENCH_SPAN_PLANE_SIZE), planes + offset, BENCH_SPAN_PLANE_SIZE, s->len);
+				}
+				break;
+			}
+		}
+	}
+	uint32_t sum = 0;
+	for (int i = 0; i < BENCH_SPAN_PAGE_SIZE; ++i) {
+		sum = sum * 31 + dst[i];
+		if (op == BENCH_SPAN_EXPAND) {
+			sum = sum * 31 + rgb[i];
+		}
+		if (op == BENCH_SPAN_PLANAR) {
+			sum = sum * 31 + chunky[i] + chunky[BENCH_SPAN_PAGE_SIZE + i] * 17;
+		}
+	}
+	return sum;
+}
+
+static void benchSpanKernels(const SpanKernels *sk, const uint32_t *reference, const BenchSpan *spans, uint8_t *dst, const uint8_t *src, uint64_t bytes) {
+	static const char *opNames[BENCH_SPAN_NUM_OPS] = { "fill", "copy", "blend", "expand", "planar" };
+
+	printf("%-10s", sk->name);
+	for (int op = 0; op < BENCH_SPAN_NUM_OPS; ++op) {
+		if (benchSpanRun(sk, op, spans, dst, src, 1) != reference[op]) {
+			printf(" %s MISMATCH", opNames[op]);
+			continue;
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		benchSpanRun(sk, op, spans, dst, src, BENCH_SPAN_PASSES);
+		printf(" %s %7.0f MB/s ", opNames[op], bytes / elapsedSeconds(start) / 1e6);
+	}
+	printf("\n");
+}
+
+void bench_spans() {
+	uint8_t *dst = (uint8_t *)malloc(BENCH_SPAN_PAGE_SIZE);
+	uint8_t *src = (uint8_t *)malloc(BENCH_SPAN_PAGE_SIZE);
+	BenchSpan *spans = new BenchSpan[BENCH_SPAN_COUNT];
+
+	uint32_t seed = 1;
+	uint64_t bytes = 0;
+	for (int i = 0; i < BENCH_SPAN_COUNT; ++i) {
+		seed = seed * 1103515245 + 12345;
+		spans[i].len = 1 + (seed >> 16) % 160;
+		spans[i].offset = (seed >> 8) % (BENCH_SPAN_PAGE_SIZE - 160);
+		spans[i].value = seed >> 24;
+		bytes += spans[i].len;
+	}
+	for (int i = 0; i < BENCH_SPAN_PAGE_SIZE; ++i) {
+#ifdef VIDEO_8BPP
+		src[i] = (i * 7) & 15; // expand expects palette indices
+#else
+		src[i] = i * 7;
+#endif
+	}
+	bytes *= BENCH_SPAN_PASSES;
+
+	uint32_t reference[BENCH_SPAN_NUM_OPS];
+	for (int op = 0; op < BENCH_SPAN_NUM_OPS; ++op) {
+		reference[op] = benchSpanRun(&spanKernelsReference, op, spans, dst, src, 1);
+	}
+
+	printf("Span kernels benchmark, %d spans of 1..160 bytes\n", BENCH_SPAN_COUNT);
+	for (const SpanKernels *const *k = span_listKernels(); *k; ++k) {
+		benchSpanKernels(*k, reference, spans, dst, src, bytes);
+	}
+	benchSpanKernels(&spanKernelsReference, reference, spans, dst, src, bytes);
+
+	delete[] spans;
+	free(src);
+	free(dst);
+}
+
+/*
+	Plays the start of the game (the intro cinematic, the heaviest polygon
+	part) with the polygons filled on the VM thread, then with the band
+	rasterizer on 1, 2, 4 and 8 threads. Every frame shown must match the
+	single threaded run. Needs the game data.
+*/
+#define BENCH_RASTER_FRAMES 2000
+
+static double benchRasterRun(const char *dataPath, int threads, uint32_t *hash) {
+	NullStub *stub = (NullStub *)System_Null_create();
+	TurboStub *sys = new TurboStub(stub);
+	Engine *e = new Engine(sys, dataPath, ".");
+	e->init();
+	e->video.setRasterThreads(threads);
+
+	double seconds = 0;
+	*hash = 0;
+	for (int i = 0; i < BENCH_RASTER_FRAMES; ++i) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool running = e->runFrame();
+		seconds += elapsedSeconds(start);
+		for (int j = 0; j < NullStub::PAGE_SIZE; ++j) {
+			*hash = *hash * 31 + stub->_page[j];
+		}
+		if (!running) {
+			break;
+		}
+	}
+
+	delete e;
+	delete sys;
+	delete stub;
+	return seconds;
+}
+
+void bench_raster(const char *dataPath) {
+	static const int threads[] = { 0, 1, 2, 4, 8 };
+
+	printf("Band rasterizer benchmark, %d frames\n", BENCH_RASTER_FRAMES);
+	uint32_t reference = 0;
+	double referenceSeconds = 0;
+	for (unsigned int i = 0; i < ARRAYSIZE(threads); ++i) {
+		uint32_t hash;
+		double seconds = benchRasterRun(dataPath, threads[i], &hash);
+		if (i == 0) {
+			reference = hash;
+			referenceSeconds = seconds;
+			printf("vm thread   %10.0f frames/s\n", BENCH_RASTER_FRAMES / seconds);
+		} else {
+			printf("%d threads   %10.0f frames/s  (x%.2f)%s\n", threads[i], BENCH_RASTER_FRAMES / seconds,
+				referenceSeconds / seconds, hash != reference ? "  MISMATCH" : "");
+		}
+	}
+}
+
+/*
+	Unpacks every packed entry of memlist.bin with the reference decoder and
+	with Bank::unpack, checks both give the same bytes and crc result, and
+	reports the unpacked MB/s of each. Needs the game data.
+*/
+#define BENCH_UNPACK_BYTES (64 * 1024 * 1024)
+
+static bool benchUnpackEntry(const MemEntry *me, const uint8_t *src, uint8_t *dst, bool reference) {
+	Bank bk;
+	bk._srcBuf = src;
+	bk._startBuf = dst;
+	bk._iBuf = src + me->packedSize - 4;
+	return reference ? bk.unpackReference() : bk.unpack();
+}
+
+void bench_unpack(const char *dataPath) {
+	Resource res(0, dataPath);
+	res.readEntries();
+
+	const MemEntry *entries[ARRAYSIZE(res._memList)];
+	int numEntries = 0;
+	uint32_t packedSize = 0, size = 0;
+	for (int i = 0; i < res._numMemList; ++i) {
+		const MemEntry *me = &res._memList[i];
+		if (me->bankId != 0 && me->packedSize != me->size && res._bankMappings[me->bankId]) {
+			entries[numEntries++] = me;
+			packedSize += me->packedSize;
+			size += me->size;
+		}
+	}
+	printf("Unpack benchmark, %d packed entries, %d bytes unpacked to %d\n", numEntries, packedSize, size);
+	if (numEntries == 0) {
+		res.freeEntries();
+		return;
+	}
+
+	uint8_t *expected = (uint8_t *)malloc(0x10000);
+	uint8_t *dst = (uint8_t *)malloc(0x10000);
+	int mismatches = 0, badCrcs = 0;
+	for (int i = 0; i < numEntries; ++i) {
+		const MemEntry *me = entries[i];
+		const uint8_t *src = res._bankMappings[me->bankId]->_data + me->bankOffset;
+		memset(expected, 0, me->size);
+		memset(dst, 0, me->size);
+		const bool expectedRet = benchUnpackEntry(me, src, expected, true);
+		const bool ret = benchUnpackEntry(me, src, dst, false);
+		if (ret != expectedRet || memcmp(dst, expected, me->size) != 0) {
+			printf("entry 0x%02X MISMATCH (crc %s, unpack %s)\n", (int)(me - res._memList), expectedRet ? "ok" : "bad", ret ? "ok" : "bad");
+			++mismatches;
+		}
+		if (!expectedRet) {
+			++badCrcs;
+		}
+	}
+
+	const int passes = BENCH_UNPACK_BYTES / size + 1;
+	for (int reference = 1; reference >= 0; --reference) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int pass = 0; pass < passes; ++pass) {
+			for (int i = 0; i < numEntries; ++i) {
+				const MemEntry *me = entries[i];
+				benchUnpackEntry(me, res._bankMappings[me->bankId]->_data + me->bankOffset, dst, reference != 0);
+			}
+		}
+		const double seconds = elapsedSeconds(start);
+		printf("%-10s %8.1f MB/s\n", reference ? "reference" : "unpack", (double)size * passes / seconds / 1e6);
+	}
+	if (badCrcs != 0) {
+		printf("%d entries fail their crc check\n", badCrcs);
+	}
+	if (mismatches != 0) {
+		printf("%d entries MISMATCH\n", mismatches);
+	}
+
+	free(expected);
+	free(dst);
+	res.freeEntries();
+}
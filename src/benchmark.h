@@ -0,0 +1,34 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include "intern.h"
+
+/*
+	Built-in benchmarks, run with --bench=NAME. They print their results on stdout
+	and do not open a window.
+*/
+extern void bench_vmDispatch();
+extern void bench_engines(const char *dataPath);
+extern void bench_spans();
+extern void bench_raster(const char *dataPath);
+extern void bench_unpack(const char *dataPath);
+
+#endif
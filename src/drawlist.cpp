@@ -0,0 +1,292 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+
+#include "drawlist.h"
+#include "video.h"
+
+
+DrawList::DrawList(Video *vid)
+	: video(vid), _threaded(false), _quit(false), _head(0), _tail(0), _blitsQueued(0), _blitsTaken(0), _blitsShown(0),
+	_holdingFrame(false), _dumpFile(0), _frame(0) {
+}
+
+DrawList::~DrawList() {
+	setRenderThread(false);
+	closeDump();
+}
+
+void DrawList::setRenderThread(bool enable) {
+	if (enable == _threaded) {
+		return;
+	}
+	if (enable) {
+		_quit = false;
+		_blitsQueued = _blitsTaken = _blitsShown = 0;
+		_threaded = true;
+		_renderThread = std::thread(&DrawList::renderLoop, this, g_debugMask);
+	} else {
+		sync();
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_quit = true;
+		}
+		_workCond.notify_one();
+		_renderThread.join();
+		_threaded = false;
+	}
+}
+
+bool DrawList::openDump(const char *path) {
+	closeDump();
+	_dumpFile = fopen(path, "w");
+	if (!_dumpFile) {
+		warning("Unable to write the draw list to '%s'", path);
+		return false;
+	}
+	fprintf(_dumpFile, "frame %u\n", _frame);
+	return true;
+}
+
+void DrawList::closeDump() {
+	if (_dumpFile) {
+		fclose(_dumpFile);
+		_dumpFile = 0;
+	}
+}
+
+void DrawList::drawPolygon(const uint8_t *buf, bool video2, uint16_t offset, uint8_t color, uint16_t zoom, int16_t x, int16_t y) {
+	DrawCommand cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = DL_POLYGON;
+	cmd.buf = buf;
+	cmd.video2 = video2;
+	cmd.offset = offset;
+	cmd.color = color;
+	cmd.zoom = zoom;
+	cmd.x = x;
+	cmd.y = y;
+	push(cmd);
+}
+
+void DrawList::drawString(uint8_t color, uint16_t x, uint16_t y, uint16_t strId) {
+	DrawCommand cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = DL_STRING;
+	cmd.offset = strId;
+	cmd.color = color;
+	cmd.x = x;
+	cmd.y = y;
+	push(cmd);
+}
+
+void DrawList::selectPage(uint8_t page) {
+	DrawCommand cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = DL_SELECT_PAGE;
+	cmd.page = page;
+	push(cmd);
+}
+
+void DrawList::fillPage(uint8_t page, uint8_t color) {
+	DrawCommand cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = DL_FILL_PAGE;
+	cmd.page = page;
+	cmd.color = color;
+	push(cmd);
+}
+
+void DrawList::copyPage(uint8_t src, uint8_t dst, int16_t vscroll) {
+	DrawCommand cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = DL_COPY_PAGE;
+	cmd.page = src;
+	cmd.dstPage = dst;
+	cmd.y = vscroll;
+	push(cmd);
+}
+
+// The palette is only picked up by the next blit.
+void DrawList::setPalette(uint8_t pal) {
+	DrawCommand cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = DL_SET_PALETTE;
+	cmd.color = pal;
+	push(cmd);
+}
+
+void DrawList::blit(uint8_t page) {
+	DrawCommand cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = DL_BLIT;
+	cmd.page = page;
+	if (_threaded) {
+		// At most one frame is held, the render thread releases it at this blit.
+		present();
+		push(cmd);
+		++_blitsQueued;
+	} else {
+		dump(cmd);
+		video->updateDisplay(page);
+	}
+	++_frame;
+	if (_dumpFile) {
+		fprintf(_dumpFile, "frame %u\n", _frame);
+	}
+}
+
+// Shows the frame of the last blit, once the render thread has taken it.
+void DrawList::present() {
+	if (!_threaded || _blitsShown == _blitsQueued) {
+		return;
+	}
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_blitsTaken != _blitsQueued) {
+			_idleCond.wait(lock);
+		}
+	}
+	video->showFrame(&_heldFrame);
+	_blitsShown = _blitsQueued;
+}
+
+// Returns once the render thread has drawn everything queued and the last frame is shown.
+void DrawList::sync() {
+	if (_threaded) {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (_tail != _head) {
+				_idleCond.wait(lock);
+			}
+		}
+		present();
+		// The render thread is idle, the pages are ours.
+		if (_holdingFrame) {
+			video->releaseFrame(&_heldFrame);
+			_holdingFrame = false;
+		}
+	}
+}
+
+void DrawList::push(const DrawCommand &cmd) {
+	dump(cmd);
+	if (!_threaded) {
+		execute(cmd);
+		return;
+	}
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (_head - _tail == QUEUE_SIZE) {
+		_idleCond.wait(lock);
+	}
+	const bool wasEmpty = (_head == _tail);
+	_queue[_head % QUEUE_SIZE] = cmd;
+	++_head;
+	lock.unlock();
+	// The render thread only sleeps on an empty queue.
+	if (wasEmpty) {
+		_workCond.notify_one();
+	}
+}
+
+void DrawList::execute(const DrawCommand &cmd) {
+	switch (cmd.type) {
+	case DL_POLYGON:
+		video->setDataBuffer((uint8_t *)cmd.buf, cmd.offset);
+		video->readAndDrawPolygon(cmd.color, cmd.zoom, Point(cmd.x, cmd.y));
+		break;
+	case DL_STRING:
+		video->drawString(cmd.color, cmd.x, cmd.y, cmd.offset);
+		break;
+	case DL_SELECT_PAGE:
+		video->changePagePtr1(cmd.page);
+		break;
+	case DL_FILL_PAGE:
+		video->fillPage(cmd.page, cmd.color);
+		break;
+	case DL_COPY_PAGE:
+		video->copyPage(cmd.page, cmd.dstPage, cmd.y);
+		break;
+	case DL_SET_PALETTE:
+		video->paletteIdRequested = cmd.color;
+		break;
+	case DL_BLIT:
+		// Only queued with a render thread. The VM showed the previous frame
+		// before queuing this blit.
+		if (_holdingFrame) {
+			video->releaseFrame(&_heldFrame);
+		}
+		video->takeFrame(cmd.page, &_heldFrame);
+		_holdingFrame = true;
+		break;
+	}
+}
+
+void DrawList::dump(const DrawCommand &cmd) {
+	if (!_dumpFile) {
+		return;
+	}
+	switch (cmd.type) {
+	case DL_POLYGON:
+		fprintf(_dumpFile, "\tpolygon %s 0x%04X color=0x%02X zoom=%d x=%d y=%d\n", cmd.video2 ? "video2" : "cinematic", cmd.offset, cmd.color, cmd.zoom, cmd.x, cmd.y);
+		break;
+	case DL_STRING:
+		fprintf(_dumpFile, "\tstring 0x%03X color=%d x=%d y=%d\n", cmd.offset, cmd.color, cmd.x, cmd.y);
+		break;
+	case DL_SELECT_PAGE:
+		fprintf(_dumpFile, "\tselect page=%d\n", cmd.page);
+		break;
+	case DL_FILL_PAGE:
+		fprintf(_dumpFile, "\tfill page=%d color=%d\n", cmd.page, cmd.color);
+		break;
+	case DL_COPY_PAGE:
+		fprintf(_dumpFile, "\tcopy page=%d to=%d vscroll=%d\n", cmd.page, cmd.dstPage, cmd.y);
+		break;
+	case DL_SET_PALETTE:
+		fprintf(_dumpFile, "\tpalette %d\n", cmd.color);
+		break;
+	case DL_BLIT:
+		fprintf(_dumpFile, "\tblit page=%d\n", cmd.page);
+		break;
+	}
+}
+
+void DrawList::renderLoop(uint16_t debugMask) {
+	g_debugMask = debugMask;
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (1) {
+		while (!_quit && _tail == _head) {
+			_workCond.wait(lock);
+		}
+		if (_tail == _head) {
+			break;
+		}
+		DrawCommand cmd = _queue[_tail % QUEUE_SIZE];
+		lock.unlock();
+		execute(cmd);
+		lock.lock();
+		++_tail;
+		if (cmd.type == DL_BLIT) {
+			++_blitsTaken;
+		}
+		// The VM waits for an empty queue (sync), for room in a full one or for a frame to show.
+		if (_tail == _head || _head - _tail == QUEUE_SIZE - 1 || cmd.type == DL_BLIT) {
+			_idleCond.notify_all();
+		}
+	}
+}
@@ -0,0 +1,114 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+
+#ifndef __DRAWLIST_H__
+#define __DRAWLIST_H__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "intern.h"
+#include "video.h"
+
+enum {
+	DL_POLYGON,     // offset, color, zoom, x, y in buf
+	DL_STRING,      // string id (offset), color, x, y
+	DL_SELECT_PAGE, // page
+	DL_FILL_PAGE,   // page, color
+	DL_COPY_PAGE,   // page to dstPage, scrolled by y
+	DL_SET_PALETTE, // palette (color)
+	DL_BLIT         // page
+};
+
+struct DrawCommand {
+	uint8_t type;
+	uint8_t color;
+	uint8_t page, dstPage;
+	uint16_t offset;
+	uint16_t zoom;
+	int16_t x, y;
+	bool video2; // buf is _segVideo2, only used by the dumps
+	const uint8_t *buf;
+};
+
+/*
+	Everything the VM draws goes through the DrawList. By default the commands
+	are run as they come. With a render thread, the VM only queues them and
+	carries on interpreting while the render thread draws into the pages.
+
+	A blit is queued too: the render thread takes the page presented as a
+	Video::Frame, a reference to its buffer, and draws the next frame while
+	the VM runs its logic. The VM thread shows the frame with present(), at
+	its next blit before pacing, or at a sync. Frames and audio still reach
+	the System from the VM thread and in the same order as without a render
+	thread, the frame is only shown once the next one has been interpreted.
+
+	The VM waits for the render thread to drain the queue (sync) only when it
+	needs the pages or the memory the commands point to: before loading
+	resources and around save states.
+
+	The commands can also be written to a text file, one frame per block, to
+	study the drawing of a part offline.
+*/
+struct DrawList {
+	enum {
+		QUEUE_SIZE = 4096
+	};
+
+	Video *video;
+
+	std::thread _renderThread;
+	std::mutex _mutex;
+	std::condition_variable _workCond;
+	std::condition_variable _idleCond;
+	bool _threaded;
+	bool _quit;
+	DrawCommand _queue[QUEUE_SIZE];
+	uint32_t _head, _tail; // commands queued and drawn so far
+	uint32_t _blitsQueued, _blitsTaken, _blitsShown;
+	Video::Frame _heldFrame; // taken by the render thread at the last blit
+	bool _holdingFrame;
+
+	FILE *_dumpFile;
+	uint32_t _frame;
+
+	DrawList(Video *vid);
+	~DrawList();
+
+	void setRenderThread(bool enable);
+	bool openDump(const char *path);
+	void closeDump();
+
+	void drawPolygon(const uint8_t *buf, bool video2, uint16_t offset, uint8_t color, uint16_t zoom, int16_t x, int16_t y);
+	void drawString(uint8_t color, uint16_t x, uint16_t y, uint16_t strId);
+	void selectPage(uint8_t page);
+	void fillPage(uint8_t page, uint8_t color);
+	void copyPage(uint8_t src, uint8_t dst, int16_t vscroll);
+	void setPalette(uint8_t pal);
+	void blit(uint8_t page);
+	void present();
+	void sync();
+
+	void push(const DrawCommand &cmd);
+	void execute(const DrawCommand &cmd);
+	void dump(const DrawCommand &cmd);
+	void renderLoop(uint16_t debugMask);
+};
+
+#endif
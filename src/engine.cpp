@@ -23,24 +23,45 @@
 #include "parts.h"
 
 Engine::Engine(System *paramSys, const char *dataDir, const char *saveDir)
-	: sys(paramSys), vm(&mixer, &res, &player, &video, sys), mixer(sys), res(&video, dataDir), 
-	player(&mixer, &res, sys), video(&res, sys), _dataDir(dataDir), _saveDir(saveDir), _stateSlot(0) {
+	: sys(paramSys), vm(&mixer, &res, &player, &drawList, sys), mixer(sys), res(&video, dataDir), 
+	player(&mixer, &res, sys), video(&res, sys), drawList(&video), _dataDir(dataDir), _saveDir(saveDir), _stateSlot(0), _debugMask(0) {
+}
+
+/*
+	The debug channels of this engine. They apply to the calling thread, which
+	should be the one running the engine, and to the threads the engine starts
+	from then on: the render thread, the raster and load pools and the prefetch
+	thread copy the mask of the thread starting them.
+*/
+void Engine::setDebugMask(uint16_t mask) {
+	_debugMask = mask;
+	g_debugMask = mask;
 }
 
 void Engine::run() {
+	g_debugMask = _debugMask;
+
+	while (runFrame()) {
+	}
 
-	while (!sys->input.quit) {
 
-		vm.checkThreadRequests();
+}
 
-		vm.inp_updatePlayer();
+/*
+	Runs one VM frame. Everything it touches belongs to this engine, so
+	several engines can run on different threads, each with its own System.
+*/
+bool Engine::runFrame() {
 
-		processInput();
+	vm.checkThreadRequests();
 
-		vm.hostFrame();
-	}
+	vm.inp_updatePlayer();
 
+	processInput();
 
+	vm.hostFrame();
+
+	return !sys->input.quit;
 }
 
 Engine::~Engine(){
@@ -61,6 +82,9 @@ void Engine::init() {
 	res.allocMemBlock();
 
 	res.readEntries();
+	if (res._cacheName) {
+		res.openCache(_saveDir);
+	}
 
 	vm.init();
 
@@ -89,9 +113,12 @@ void Engine::init() {
 }
 
 void Engine::finish() {
+	drawList.setRenderThread(false);
 	player.free();
 	mixer.free();
 	res.freeMemBlock();
+	res.freeEntries();
+	video.free();
 }
 
 void Engine::processInput() {
@@ -133,6 +160,7 @@ void Engine::saveGameState(uint8_t slot, const char *desc) {
 		f.write(hdrdesc, sizeof(hdrdesc));
 		// contents
 		Serializer s(&f, Serializer::SM_SAVE, res._memPtrStart);
+		drawList.sync();
 		vm.saveOrLoad(s);
 		res.saveOrLoad(s);
 		video.saveOrLoad(s);
@@ -167,11 +195,15 @@ void Engine::loadGameState(uint8_t slot) {
 			f.read(hdrdesc, sizeof(hdrdesc));
 			// contents
 			Serializer s(&f, Serializer::SM_LOAD, res._memPtrStart, ver);
+			drawList.sync();
 			vm.saveOrLoad(s);
 			res.saveOrLoad(s);
 			video.saveOrLoad(s);
 			player.saveOrLoad(s);
 			mixer.saveOrLoad(s);
+			// segBytecode has been reloaded, decode it again.
+			vm.resetInstructionCache();
+			res.prefetchPart(vm.predictNextPart());
 		}
 		if (f.ioErr()) {
 			warning("I/O error when loading game state");
@@ -25,6 +25,7 @@
 #include "sfxplayer.h"
 #include "resource.h"
 #include "video.h"
+#include "drawlist.h"
 
 struct System;
 
@@ -39,13 +40,17 @@ struct Engine {
 	Resource res;
 	SfxPlayer player;
 	Video video;
+	DrawList drawList;
 	const char *_dataDir, *_saveDir;
 	uint8_t _stateSlot;
+	uint16_t _debugMask;
 
 	Engine(System *stub, const char *dataDir, const char *saveDir);
 	~Engine();
 
+	void setDebugMask(uint16_t mask);
 	void run();
+	bool runFrame();
 	void init();
 	void finish();
 	void processInput();
@@ -0,0 +1,262 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+
+#include <zlib.h>
+#include "golden.h"
+#include "util.h"
+
+
+static void convertPalette(const uint8_t *p, uint8_t rgb[][3]) {
+	for (int i = 0; i < NUM_COLORS; ++i) {
+		const uint8_t c1 = p[i * 2 + 0];
+		const uint8_t c2 = p[i * 2 + 1];
+		rgb[i][0] = (((c1 & 0x0F) << 2) | ((c1 & 0x0F) >> 2)) << 2;
+		rgb[i][1] = (((c2 & 0xF0) >> 2) | ((c2 & 0xF0) >> 6)) << 2;
+		rgb[i][2] = (((c2 & 0x0F) >> 2) | ((c2 & 0x0F) << 2)) << 2;
+	}
+}
+
+GoldenStub::GoldenStub(System *host)
+	: SystemProxy(host), _f(true), _filename(0), _directory(0), _recording(false), _comparing(false), _diverged(false), _ended(false),
+	_seed(0), _framesCount(0), _audioBlocksCount(0), _audioCallback(0), _audioParam(0) {
+	memset(_palette, 0, sizeof(_palette));
+	memset(_frame, 0, sizeof(_frame));
+	memset(_prevFrame, 0, sizeof(_prevFrame));
+	memset(_goldenPalette, 0, sizeof(_goldenPalette));
+}
+
+bool GoldenStub::create(const char *filename, const char *directory, uint16_t seed) {
+	if (!_f.open(filename, directory, "wb")) {
+		warning("Unable to create golden file '%s'", filename);
+		return false;
+	}
+	_f.writeUint32BE('AWGH');
+	_f.writeUint16BE(VERSION);
+	_f.writeUint16BE(seed);
+	_filename = filename;
+	_directory = directory;
+	_seed = seed;
+	_recording = true;
+	return true;
+}
+
+bool GoldenStub::open(const char *filename, const char *directory) {
+	if (!_f.open(filename, directory, "rb")) {
+		warning("Unable to open golden file '%s'", filename);
+		return false;
+	}
+	if (_f.readUint32BE() != 'AWGH') {
+		warning("Bad golden file format");
+		return false;
+	}
+	uint16_t ver = _f.readUint16BE();
+	if (ver != VERSION) {
+		warning("Unsupported golden file version %d", ver);
+		return false;
+	}
+	_seed = _f.readUint16BE();
+	_filename = filename;
+	_directory = directory;
+	_comparing = !_f.ioErr();
+	return _comparing;
+}
+
+void GoldenStub::destroy() {
+	if (_comparing) {
+		_f.readByte();
+		if (!_f.ioErr()) {
+			diverge("the golden run goes on");
+		}
+	}
+	if (_recording && _f.ioErr()) {
+		warning("I/O error when writing golden file '%s'", _filename);
+	}
+	_f.close();
+	_recording = _comparing = false;
+	SystemProxy::destroy();
+}
+
+void GoldenStub::setPalette(const uint8_t *buf) {
+	memcpy(_palette, buf, sizeof(_palette));
+	SystemProxy::setPalette(buf);
+}
+
+void GoldenStub::updateDisplay(const uint8_t *buf, const DisplayRect *rects, int numRects) {
+	if (_recording || _comparing) {
+		// Frames with no damage count too, the game shows them for a while.
+		for (int y = 0; y < FRAME_H; ++y) {
+			const uint8_t *src = buf + y * VIDEO_SCALE * VID_PITCH;
+			uint8_t *dst = _frame + y * FRAME_W;
+			for (int x = 0; x < FRAME_W; ++x) {
+#ifdef VIDEO_8BPP
+				dst[x] = src[x * VIDEO_SCALE];
+#else
+				dst[x] = (x & 1) ? (src[x >> 1] & 0xF) : (src[x >> 1] >> 4);
+#endif
+			}
+		}
+		uint32_t crc = crc32(0, _frame, FRAME_SIZE);
+		crc = crc32(crc, _palette, sizeof(_palette));
+		addFrame(crc);
+		++_framesCount;
+	}
+	SystemProxy::updateDisplay(buf, rects, numRects);
+}
+
+void GoldenStub::processEvents() {
+	SystemProxy::processEvents();
+	if (_diverged || _ended) {
+		input.quit = true;
+	}
+}
+
+void GoldenStub::startAudio(AudioCallback callback, void *param) {
+	_audioCallback = callback;
+	_audioParam = param;
+	SystemProxy::startAudio(mixAudio, this);
+}
+
+void GoldenStub::stopAudio() {
+	SystemProxy::stopAudio();
+	_audioCallback = 0;
+	_audioParam = 0;
+}
+
+void GoldenStub::mixAudio(void *param, uint8_t *buf, int len) {
+	GoldenStub *stub = (GoldenStub *)param;
+	stub->_audioCallback(stub->_audioParam, buf, len);
+	if (stub->_recording || stub->_comparing) {
+		stub->addAudio(crc32(0, buf, len), len);
+		++stub->_audioBlocksCount;
+	}
+}
+
+void GoldenStub::addFrame(uint32_t crc) {
+	if (_recording) {
+		_f.writeByte(REC_FRAME);
+		_f.writeUint32BE(crc);
+		_f.write(_palette, sizeof(_palette));
+		for (int i = 0; i < FRAME_SIZE; ++i) {
+			_delta[i] = _frame[i] ^ _prevFrame[i];
+		}
+		_f.write(_delta, FRAME_SIZE);
+		memcpy(_prevFrame, _frame, FRAME_SIZE);
+	} else if (readRecord(REC_FRAME)) {
+		const uint32_t goldenCrc = _f.readUint32BE();
+		_f.read(_goldenPalette, sizeof(_goldenPalette));
+		_f.read(_delta, FRAME_SIZE);
+		for (int i = 0; i < FRAME_SIZE; ++i) {
+			_prevFrame[i] ^= _delta[i];
+		}
+		if (_f.ioErr()) {
+			diverge("truncated golden file");
+		} else if (crc != goldenCrc) {
+			diverge("the frame differs");
+			dumpFrame();
+		}
+	}
+}
+
+void GoldenStub::addAudio(uint32_t crc, uint16_t len) {
+	if (_recording) {
+		_f.writeByte(REC_AUDIO);
+		_f.writeUint32BE(crc);
+		_f.writeUint16BE(len);
+	} else if (readRecord(REC_AUDIO)) {
+		const uint32_t goldenCrc = _f.readUint32BE();
+		const uint16_t goldenLen = _f.readUint16BE();
+		if (_f.ioErr()) {
+			diverge("truncated golden file");
+		} else if (len != goldenLen) {
+			char msg[64];
+			snprintf(msg, sizeof(msg), "the audio block has %d bytes instead of %d", len, goldenLen);
+			diverge(msg);
+		} else if (crc != goldenCrc) {
+			diverge("the audio block differs");
+		}
+	}
+}
+
+bool GoldenStub::readRecord(uint8_t type) {
+	if (!_comparing) {
+		return false;
+	}
+	const uint8_t goldenType = _f.readByte();
+	if (_f.ioErr()) {
+		// The run stops at the end of the golden one, anything drawn or mixed
+		// before the engine sees the quit is not compared.
+		debug(DBG_INFO, "Golden run finished after %d frames", _framesCount);
+		_comparing = false;
+		_ended = true;
+		return false;
+	}
+	if (goldenType != type) {
+		diverge(type == REC_FRAME ? "a frame was shown instead of an audio block" : "an audio block was mixed instead of a frame");
+		return false;
+	}
+	return true;
+}
+
+void GoldenStub::diverge(const char *what) {
+	warning("Golden run differs at frame %d, audio block %d: %s", _framesCount, _audioBlocksCount, what);
+	_comparing = false;
+	_diverged = true;
+}
+
+void GoldenStub::dumpFrame() {
+	char name[256];
+	snprintf(name, sizeof(name), "%s-%d.ppm", _filename, _framesCount);
+	File f;
+	if (!f.open(name, _directory, "wb")) {
+		warning("Unable to create '%s'", name);
+		return;
+	}
+	char header[32];
+	const int headerSize = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", FRAME_W * 3, FRAME_H);
+	f.write(header, headerSize);
+
+	// Side by side: the golden frame, the frame of the run, and the pixels
+	// that do not look the same in magenta over a dimmed copy of the run.
+	uint8_t goldenRgb[NUM_COLORS][3];
+	uint8_t rgb[NUM_COLORS][3];
+	convertPalette(_goldenPalette, goldenRgb);
+	convertPalette(_palette, rgb);
+	uint8_t line[FRAME_W * 3 * 3];
+	for (int y = 0; y < FRAME_H; ++y) {
+		uint8_t *golden = line;
+		uint8_t *actual = line + FRAME_W * 3;
+		uint8_t *diff = line + FRAME_W * 3 * 2;
+		for (int x = 0; x < FRAME_W; ++x) {
+			const uint8_t *g = goldenRgb[_prevFrame[y * FRAME_W + x]];
+			const uint8_t *a = rgb[_frame[y * FRAME_W + x]];
+			const bool same = (g[0] == a[0] && g[1] == a[1] && g[2] == a[2]);
+			for (int i = 0; i < 3; ++i) {
+				golden[x * 3 + i] = g[i];
+				actual[x * 3 + i] = a[i];
+				diff[x * 3 + i] = same ? (a[i] >> 2) : (i == 1 ? 0 : 0xFF);
+			}
+		}
+		f.write(line, sizeof(line));
+	}
+	if (f.ioErr()) {
+		warning("I/O error when writing '%s'", name);
+	} else {
+		warning("Golden and actual frames written to '%s'", name);
+	}
+}
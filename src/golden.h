@@ -0,0 +1,110 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __GOLDEN_H__
+#define __GOLDEN_H__
+
+#include "sysProxy.h"
+#include "file.h"
+
+/*
+	Golden runs: a hash of every frame shown and of every audio block mixed,
+	to check that a change to the engine did not change what the game produces.
+
+	GoldenStub either records them to a file or compares a run against one, and
+	reports the first difference. The run must only depend on its input: the
+	virtual clock of TurboStub, the random seed kept in the file, and a replay
+	for anything past the intro. A compared run stops where the golden one did.
+
+	The file is gzipped and starts with a header:
+
+		uint32_t 'AWGH'
+		uint16_t version
+		uint16_t random seed (VM_VARIABLE_RANDOM_SEED)
+
+	followed by one record per event, in the order they happened:
+
+		'F' uint32_t crc32 of the pixels and the palette
+		    uint8_t  palette[32], as given to setPalette()
+		    uint8_t  pixels[320 * 200], one palette index each, XORed with
+		             the previous frame
+		'A' uint32_t crc32 of the block
+		    uint16_t length of the block
+
+	Frames are stored in the 320x200 layout whatever the page format, so a 4bpp
+	and an 8bpp build give the same file (scaled builds draw other pixels).
+	They let the first differing frame be dumped as a PPM image next to the
+	golden file: the golden frame, the frame of the run and the pixels that
+	differ.
+*/
+struct GoldenStub : SystemProxy {
+	enum {
+		VERSION = 1,
+		FRAME_W = VID_NATIVE_WIDTH,
+		FRAME_H = VID_NATIVE_HEIGHT,
+		FRAME_SIZE = FRAME_W * FRAME_H
+	};
+
+	enum {
+		REC_FRAME = 'F',
+		REC_AUDIO = 'A'
+	};
+
+	File _f;
+	const char *_filename;
+	const char *_directory;
+	bool _recording;
+	bool _comparing;
+	bool _diverged;
+	bool _ended;
+	uint16_t _seed;
+	uint32_t _framesCount;
+	uint32_t _audioBlocksCount;
+
+	uint8_t _palette[NUM_COLORS * 2];
+	uint8_t _frame[FRAME_SIZE];
+	uint8_t _prevFrame[FRAME_SIZE]; // the frame before, the golden one when comparing
+	uint8_t _goldenPalette[NUM_COLORS * 2];
+	uint8_t _delta[FRAME_SIZE];
+
+	AudioCallback _audioCallback;
+	void *_audioParam;
+
+	GoldenStub(System *host);
+	virtual ~GoldenStub() {}
+
+	bool create(const char *filename, const char *directory, uint16_t seed);
+	bool open(const char *filename, const char *directory);
+
+	virtual void destroy();
+	virtual void setPalette(const uint8_t *buf);
+	virtual void updateDisplay(const uint8_t *buf, const DisplayRect *rects, int numRects);
+	virtual void processEvents();
+	virtual void startAudio(AudioCallback callback, void *param);
+	virtual void stopAudio();
+
+	static void mixAudio(void *param, uint8_t *buf, int len);
+
+	void addFrame(uint32_t crc);
+	void addAudio(uint32_t crc, uint16_t len);
+	bool readRecord(uint8_t type);
+	void diverge(const char *what);
+	void dumpFrame();
+};
+
+#endif
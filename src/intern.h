@@ -38,6 +38,20 @@ inline void SWAP(T &a, T &b) {
 	b = tmp;
 }
 
+// Index of the lowest set bit of a non-zero mask.
+inline int lowestBit64(uint64_t mask) {
+#if defined(__GNUC__)
+	return __builtin_ctzll(mask);
+#else
+	int i = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		++i;
+	}
+	return i;
+#endif
+}
+
 struct Ptr {
 	uint8_t *pc;
 	
@@ -18,14 +18,35 @@
 
 #include "engine.h"
 #include "sys.h"
+#include "sysTurbo.h"
+#include "replay.h"
+#include "golden.h"
+#include "profiler.h"
 #include "util.h"
+#include "benchmark.h"
 
 
 static const char *USAGE = 
 	"Raw - Another World Interpreter\n"
 	"Usage: raw [OPTIONS]...\n"
 	"  --datapath=PATH   Path to where the game is installed (default '.')\n"
-	"  --savepath=PATH   Path to where the save files are stored (default '.')\n";
+	"  --savepath=PATH   Path to where the save files are stored (default '.')\n"
+	"  --bench=NAME      Run a built-in benchmark and exit (vm, engines, spans, raster, unpack)\n"
+	"  --turbo           Run on a virtual clock, as fast as possible\n"
+	"  --system=NAME     System backend to use (sdl, null)\n"
+	"  --record=FILE     Record the player input to FILE in the save path\n"
+	"  --replay=FILE     Replay the player input from FILE in the save path\n"
+	"  --golden-record=FILE  Hash every frame and audio block to FILE in the save path\n"
+	"  --golden=FILE     Compare the run with FILE in the save path, report the first difference\n"
+	"  --profile=FILE    Profile the VM, write the report to FILE at exit or on SIGUSR1\n"
+	"                    (JSON if FILE ends with .json)\n"
+	"  --debug=MASK      Enable the DBG_* debug channels in MASK (e.g. 0x20 for info)\n"
+	"  --raster=N        Fill polygons on N threads, one horizontal band each\n"
+	"  --load-threads=N  Read and unpack the resources of a part on N threads\n"
+	"  --prefetch        Read the next part in the background while the current one runs\n"
+	"  --pipeline        Draw on a render thread while the VM runs ahead\n"
+	"  --dump-drawlist=FILE  Write the draw commands of every frame to FILE\n"
+	"  --cache=FILE      Keep the unpacked resources in FILE in the save path, built on first run\n";
 
 static bool parseOption(const char *arg, const char *longCmd, const char **opt) {
 	bool ret = false;
@@ -42,18 +63,66 @@ static bool parseOption(const char *arg, const char *longCmd, const char **opt)
 	We use here a design pattern found in Doom3:
 	An Abstract Class pointer pointing to the implementation on the Heap.
 */
-//extern System *System_SDL_create();
-extern System *stub ;//= System_SDL_create();
+#ifdef SYS_SDL
+extern System *System_SDL_create();
+#endif
+extern System *System_Null_create();
+
+static System *createSystem(const char *name) {
+#ifdef SYS_SDL
+	if (strcmp(name, "sdl") == 0) {
+		return System_SDL_create();
+	}
+#endif
+	if (strcmp(name, "null") == 0) {
+		return System_Null_create();
+	}
+	return 0;
+}
 
 #undef main
 int main(int argc, char *argv[]) {
 	const char *dataPath = ".";
 	const char *savePath = ".";
+	const char *benchName = 0;
+	const char *turbo = 0;
+	const char *recordName = 0;
+	const char *replayName = 0;
+	const char *goldenRecordName = 0;
+	const char *goldenName = 0;
+	const char *profilePath = 0;
+	const char *debugMask = 0;
+	const char *rasterThreads = 0;
+	const char *loadThreads = 0;
+	const char *prefetch = 0;
+	const char *pipeline = 0;
+	const char *drawListPath = 0;
+	const char *cacheName = 0;
+#ifdef SYS_SDL
+	const char *systemName = "sdl";
+#else
+	const char *systemName = "null";
+#endif
 	for (int i = 1; i < argc; ++i) {
 		bool opt = false;
 		if (strlen(argv[i]) >= 2) {
 			opt |= parseOption(argv[i], "datapath=", &dataPath);
 			opt |= parseOption(argv[i], "savepath=", &savePath);
+			opt |= parseOption(argv[i], "bench=", &benchName);
+			opt |= parseOption(argv[i], "turbo", &turbo);
+			opt |= parseOption(argv[i], "system=", &systemName);
+			opt |= parseOption(argv[i], "record=", &recordName);
+			opt |= parseOption(argv[i], "replay=", &replayName);
+			opt |= parseOption(argv[i], "golden-record=", &goldenRecordName);
+			opt |= parseOption(argv[i], "golden=", &goldenName);
+			opt |= parseOption(argv[i], "profile=", &profilePath);
+			opt |= parseOption(argv[i], "debug=", &debugMask);
+			opt |= parseOption(argv[i], "raster=", &rasterThreads);
+			opt |= parseOption(argv[i], "load-threads=", &loadThreads);
+			opt |= parseOption(argv[i], "prefetch", &prefetch);
+			opt |= parseOption(argv[i], "pipeline", &pipeline);
+			opt |= parseOption(argv[i], "dump-drawlist=", &drawListPath);
+			opt |= parseOption(argv[i], "cache=", &cacheName);
 
 		}
 		if (!opt) {
@@ -61,20 +130,130 @@ int main(int argc, char *argv[]) {
 			return 0;
 		}
 	}
+	if (benchName) {
+		if (strcmp(benchName, "vm") == 0) {
+			bench_vmDispatch();
+		} else if (strcmp(benchName, "engines") == 0) {
+			bench_engines(dataPath);
+		} else if (strcmp(benchName, "spans") == 0) {
+			bench_spans();
+		} else if (strcmp(benchName, "raster") == 0) {
+			bench_raster(dataPath);
+		} else if (strcmp(benchName, "unpack") == 0) {
+			bench_unpack(dataPath);
+		} else {
+			printf("%s",USAGE);
+		}
+		return 0;
+	}
+
+	System *stub = createSystem(systemName);
+	if (!stub) {
+		printf("%s",USAGE);
+		return 0;
+	}
+	System *sys = stub;
+	TurboStub *turboStub = 0;
+	// Golden runs must not depend on the wall clock. --pipeline does not change
+	// them: frames are still presented and audio mixed on the VM thread, a
+	// frame held by the render thread is shown before the pause that mixes the
+	// audio following it.
+	if (goldenName || goldenRecordName) {
+		turbo = "";
+	}
+	if (turbo) {
+		turboStub = new TurboStub(sys);
+		sys = turboStub;
+	}
+	RecordStub *recordStub = 0;
+	ReplayStub *replayStub = 0;
+	if (replayName) {
+		replayStub = new ReplayStub(sys);
+		if (!replayStub->open(replayName, savePath)) {
+			error("Unable to replay '%s'", replayName);
+		}
+		sys = replayStub;
+	} else if (recordName) {
+		recordStub = new RecordStub(sys);
+		sys = recordStub;
+	}
+	GoldenStub *goldenStub = 0;
+	if (goldenName) {
+		goldenStub = new GoldenStub(sys);
+		if (!goldenStub->open(goldenName, savePath)) {
+			error("Unable to compare with '%s'", goldenName);
+		}
+		sys = goldenStub;
+	} else if (goldenRecordName) {
+		goldenStub = new GoldenStub(sys);
+		sys = goldenStub;
+	}
+
+	Engine* e = new Engine(sys, dataPath, savePath);
 	//FCS
-	//g_debugMask = DBG_INFO; // DBG_VM | DBG_BANK | DBG_VIDEO | DBG_SER | DBG_SND
-	//g_debugMask = 0 ;//DBG_INFO |  DBG_VM | DBG_BANK | DBG_VIDEO | DBG_SER | DBG_SND ;
-	
-	Engine* e = new Engine(stub, dataPath, savePath);
+	//e->setDebugMask(DBG_INFO); // DBG_VM | DBG_BANK | DBG_VIDEO | DBG_SER | DBG_SND
+	if (debugMask) {
+		e->setDebugMask(strtol(debugMask, 0, 0));
+	}
+	VMProfiler *profiler = 0;
+	if (profilePath) {
+		profiler = new VMProfiler(profilePath);
+		VMProfiler::installSignalHandler();
+		e->vm._profiler = profiler;
+	}
+	e->res._cacheName = cacheName;
+	e->res._prefetch = prefetch != 0;
+	if (loadThreads) {
+		e->res.setLoadThreads(atoi(loadThreads));
+	}
 	e->init();
+	if (rasterThreads) {
+		e->video.setRasterThreads(atoi(rasterThreads));
+	}
+	if (drawListPath) {
+		e->drawList.openDump(drawListPath);
+	}
+	if (pipeline) {
+		e->drawList.setRenderThread(true);
+	}
+
+	// The seed is the only input besides the player's that changes the game.
+	if (replayStub) {
+		e->vm.vmVariables[VM_VARIABLE_RANDOM_SEED] = replayStub->_seed;
+	} else if (recordStub) {
+		recordStub->open(recordName, savePath, e->vm.vmVariables[VM_VARIABLE_RANDOM_SEED]);
+	}
+	if (goldenName) {
+		e->vm.vmVariables[VM_VARIABLE_RANDOM_SEED] = goldenStub->_seed;
+	} else if (goldenRecordName) {
+		if (!goldenStub->create(goldenRecordName, savePath, e->vm.vmVariables[VM_VARIABLE_RANDOM_SEED])) {
+			error("Unable to record to '%s'", goldenRecordName);
+		}
+	}
+
 	e->run();
 
+	if (profiler) {
+		profiler->dump();
+		delete profiler;
+	}
 
 	delete e;
 
-	//delete stub;
+	int ret = 0;
+	if (goldenStub) {
+		printf("Golden run: %d frames, %d audio blocks, %s\n", goldenStub->_framesCount, goldenStub->_audioBlocksCount,
+			goldenName ? (goldenStub->_diverged ? "differs" : "matches") : "recorded");
+		ret = goldenStub->_diverged ? 1 : 0;
+	}
 
-	return 0;
+	delete goldenStub;
+	delete replayStub;
+	delete recordStub;
+	delete turboStub;
+	delete stub;
+
+	return ret;
 }
 
 
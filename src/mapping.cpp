@@ -0,0 +1,173 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+
+#include <mutex>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "mapping.h"
+#include "util.h"
+
+
+static std::mutex _mappingsMutex;
+static FileMapping *_mappings = 0;
+
+FileMapping *FileMapping::acquire(const char *filename, const char *directory) {
+	FileMapping tmp;
+	snprintf(tmp._path, sizeof(tmp._path), "%s/%s", directory, filename);
+	char *p = tmp._path + strlen(directory) + 1;
+
+	std::lock_guard<std::mutex> lock(_mappingsMutex);
+	for (int i = 0; i < 2; ++i) {
+		if (i == 0) {
+			string_lower(p);
+		} else { // let's try uppercase
+			string_upper(p);
+		}
+		if (!tmp.identify()) {
+			continue;
+		}
+		for (FileMapping *m = _mappings; m; m = m->_next) {
+			if (m->sameFile(tmp)) {
+				++m->_refs;
+				return m;
+			}
+		}
+		if (tmp.map()) {
+			FileMapping *m = new FileMapping(tmp);
+			m->_refs = 1;
+			m->_next = _mappings;
+			_mappings = m;
+			debug(DBG_BANK, "FileMapping::acquire() mapped '%s' size=%d", m->_path, m->_size);
+			return m;
+		}
+	}
+	return 0;
+}
+
+void FileMapping::release(FileMapping *m) {
+	if (!m) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(_mappingsMutex);
+	if (--m->_refs == 0) {
+		FileMapping **prev = &_mappings;
+		while (*prev != m) {
+			prev = &(*prev)->_next;
+		}
+		*prev = m->_next;
+		m->unmap();
+		delete m;
+	}
+}
+
+#ifdef _WIN32
+
+bool FileMapping::identify() {
+	FILE *fp = fopen(_path, "rb");
+	if (!fp) {
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
+
+bool FileMapping::sameFile(const FileMapping &m) const {
+	return strcmp(_path, m._path) == 0;
+}
+
+bool FileMapping::map() {
+	FILE *fp = fopen(_path, "rb");
+	if (!fp) {
+		return false;
+	}
+	fseek(fp, 0, SEEK_END);
+	_size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	uint8_t *buf = (uint8_t *)malloc(_size ? _size : 1);
+	const bool ok = buf && fread(buf, 1, _size, fp) == _size;
+	fclose(fp);
+	if (!ok) {
+		free(buf);
+		return false;
+	}
+	_data = buf;
+	return true;
+}
+
+void FileMapping::unmap() {
+	free((void *)_data);
+	_data = 0;
+}
+
+#else
+
+bool FileMapping::identify() {
+	struct stat st;
+	if (::stat(_path, &st) != 0) {
+		return false;
+	}
+	_dev = st.st_dev;
+	_ino = st.st_ino;
+	return true;
+}
+
+bool FileMapping::sameFile(const FileMapping &m) const {
+	return _dev == m._dev && _ino == m._ino;
+}
+
+bool FileMapping::map() {
+	const int fd = ::open(_path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return false;
+	}
+	// The file may have been replaced since identify().
+	_dev = st.st_dev;
+	_ino = st.st_ino;
+	_size = st.st_size;
+	_data = 0;
+	if (_size != 0) {
+		void *p = mmap(0, _size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			::close(fd);
+			return false;
+		}
+		_data = (const uint8_t *)p;
+	}
+	// The mapping stays valid once the descriptor is closed.
+	::close(fd);
+	return true;
+}
+
+void FileMapping::unmap() {
+	if (_data) {
+		munmap((void *)_data, _size);
+		_data = 0;
+	}
+}
+
+#endif
@@ -0,0 +1,55 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+
+#ifndef __MAPPING_H__
+#define __MAPPING_H__
+
+#include "intern.h"
+
+/*
+	A read-only view of a whole data file: memlist.bin and the bank files.
+
+	Mappings are shared by the whole process. acquire() returns the mapping of
+	a file already mapped, by any engine, and only maps it the first time;
+	release() unmaps it once its last user is gone. The file name is looked up
+	lowercase, then uppercase, like File::open().
+
+	On POSIX systems the file is mmap'ed, so the resources are read straight
+	from the page cache, and files are told apart by device and inode: a file
+	renamed over a mapped one, like a rebuilt resource cache, gets a mapping
+	of its own. Elsewhere it is read once into memory and matched by path.
+*/
+struct FileMapping {
+	char _path[512];
+	const uint8_t *_data;
+	uint32_t _size;
+	uint64_t _dev, _ino;
+	int _refs;
+	FileMapping *_next;
+
+	static FileMapping *acquire(const char *filename, const char *directory);
+	static void release(FileMapping *m);
+
+	bool identify();
+	bool sameFile(const FileMapping &m) const;
+	bool map();
+	void unmap();
+};
+
+#endif
@@ -0,0 +1,182 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <signal.h>
+#include "profiler.h"
+#include "util.h"
+
+
+static const char *opcodeNames[VMProfiler::NUM_OPCODE_SLOTS] = {
+	/* 0x00 */ "movConst", "mov", "add", "addConst",
+	/* 0x04 */ "call", "ret", "pauseThread", "jmp",
+	/* 0x08 */ "setSetVect", "jnz", "condJmp", "setPalette",
+	/* 0x0C */ "resetThread", "selectVideoPage", "fillVideoPage", "copyVideoPage",
+	/* 0x10 */ "blitFramebuffer", "killThread", "drawString", "sub",
+	/* 0x14 */ "and", "or", "shl", "shr",
+	/* 0x18 */ "playSound", "updateMemList", "playMusic", "drawCinematicPolygon",
+	/* 0x1C */ "drawPolygon", "invalid"
+};
+
+#if defined(__i386__) || defined(__x86_64__)
+static const char *tickUnit = "tsc";
+#else
+static const char *tickUnit = "ns";
+#endif
+
+static volatile sig_atomic_t dumpRequested = 0;
+
+#ifdef SIGUSR1
+static void onDumpSignal(int) {
+	dumpRequested = 1;
+}
+#endif
+
+VMProfiler::VMProfiler(const char *path)
+	: _path(path) {
+	reset();
+}
+
+void VMProfiler::reset() {
+	memset(_opcodes, 0, sizeof(_opcodes));
+	memset(_threads, 0, sizeof(_threads));
+	memset(_threadSlices, 0, sizeof(_threadSlices));
+	memset(_parts, 0, sizeof(_parts));
+	memset(_partFrames, 0, sizeof(_partFrames));
+	_curPart = 0;
+}
+
+void VMProfiler::installSignalHandler() {
+#ifdef SIGUSR1
+	signal(SIGUSR1, onDumpSignal);
+#endif
+}
+
+void VMProfiler::beginFrame(uint16_t partId) {
+	if (dumpRequested) {
+		dumpRequested = 0;
+		dump();
+	}
+	_curPart = (partId >= GAME_PART_FIRST && partId <= GAME_PART_LAST) ? partId - GAME_PART_FIRST : 0;
+	_partFrames[_curPart]++;
+}
+
+void VMProfiler::countSlice(int threadId, uint32_t instructions, uint64_t ticks) {
+	_threads[threadId].count += instructions;
+	_threads[threadId].ticks += ticks;
+	_threadSlices[threadId]++;
+	_parts[_curPart].count += instructions;
+	_parts[_curPart].ticks += ticks;
+}
+
+void VMProfiler::dump() {
+	bool json = false;
+	size_t len = strlen(_path);
+	if (len >= 5 && strcmp(_path + len - 5, ".json") == 0) {
+		json = true;
+	}
+	FILE *fp = fopen(_path, "w");
+	if (!fp) {
+		warning("Unable to write VM profile to '%s'", _path);
+		return;
+	}
+	if (json) {
+		writeJson(fp);
+	} else {
+		writeTable(fp);
+	}
+	fclose(fp);
+	debug(DBG_INFO, "VM profile written to '%s'", _path);
+}
+
+void VMProfiler::writeTable(FILE *fp) {
+	uint64_t totalCount = 0, totalTicks = 0;
+	for (int i = 0; i < NUM_OPCODE_SLOTS; ++i) {
+		totalCount += _opcodes[i].count;
+		totalTicks += _opcodes[i].ticks;
+	}
+	fprintf(fp, "VM profile, %llu instructions, %llu ticks (%s)\n\n", (unsigned long long)totalCount, (unsigned long long)totalTicks, tickUnit);
+
+	fprintf(fp, "opcode                     count    %%count             ticks    %%ticks  ticks/op\n");
+	for (int i = 0; i < NUM_OPCODE_SLOTS; ++i) {
+		const Counter *c = &_opcodes[i];
+		if (c->count == 0) {
+			continue;
+		}
+		fprintf(fp, "0x%02X %-18s %10llu %8.2f%% %16llu %8.2f%% %9.1f\n", i, opcodeNames[i],
+			(unsigned long long)c->count, c->count * 100. / totalCount,
+			(unsigned long long)c->ticks, totalTicks ? c->ticks * 100. / totalTicks : 0.,
+			(double)c->ticks / c->count);
+	}
+
+	fprintf(fp, "\nthread      slices  instructions             ticks    %%ticks\n");
+	for (int i = 0; i < VM_NUM_THREADS; ++i) {
+		const Counter *c = &_threads[i];
+		if (_threadSlices[i] == 0) {
+			continue;
+		}
+		fprintf(fp, "%6d %11llu %13llu %17llu %8.2f%%\n", i, (unsigned long long)_threadSlices[i],
+			(unsigned long long)c->count, (unsigned long long)c->ticks, totalTicks ? c->ticks * 100. / totalTicks : 0.);
+	}
+
+	fprintf(fp, "\npart        frames  instructions             ticks    %%ticks\n");
+	for (int i = 0; i < NUM_PARTS; ++i) {
+		const Counter *c = &_parts[i];
+		if (_partFrames[i] == 0) {
+			continue;
+		}
+		fprintf(fp, "0x%04X %11llu %13llu %17llu %8.2f%%\n", GAME_PART_FIRST + i, (unsigned long long)_partFrames[i],
+			(unsigned long long)c->count, (unsigned long long)c->ticks, totalTicks ? c->ticks * 100. / totalTicks : 0.);
+	}
+}
+
+void VMProfiler::writeJson(FILE *fp) {
+	fprintf(fp, "{\n  \"tickUnit\": \"%s\",\n  \"opcodes\": [", tickUnit);
+	bool first = true;
+	for (int i = 0; i < NUM_OPCODE_SLOTS; ++i) {
+		const Counter *c = &_opcodes[i];
+		if (c->count == 0) {
+			continue;
+		}
+		fprintf(fp, "%s\n    { \"opcode\": %d, \"name\": \"%s\", \"count\": %llu, \"ticks\": %llu }", first ? "" : ",",
+			i, opcodeNames[i], (unsigned long long)c->count, (unsigned long long)c->ticks);
+		first = false;
+	}
+	fprintf(fp, "\n  ],\n  \"threads\": [");
+	first = true;
+	for (int i = 0; i < VM_NUM_THREADS; ++i) {
+		const Counter *c = &_threads[i];
+		if (_threadSlices[i] == 0) {
+			continue;
+		}
+		fprintf(fp, "%s\n    { \"thread\": %d, \"slices\": %llu, \"instructions\": %llu, \"ticks\": %llu }", first ? "" : ",",
+			i, (unsigned long long)_threadSlices[i], (unsigned long long)c->count, (unsigned long long)c->ticks);
+		first = false;
+	}
+	fprintf(fp, "\n  ],\n  \"parts\": [");
+	first = true;
+	for (int i = 0; i < NUM_PARTS; ++i) {
+		const Counter *c = &_parts[i];
+		if (_partFrames[i] == 0) {
+			continue;
+		}
+		fprintf(fp, "%s\n    { \"part\": %d, \"frames\": %llu, \"instructions\": %llu, \"ticks\": %llu }", first ? "" : ",",
+			GAME_PART_FIRST + i, (unsigned long long)_partFrames[i], (unsigned long long)c->count, (unsigned long long)c->ticks);
+		first = false;
+	}
+	fprintf(fp, "\n  ]\n}\n");
+}
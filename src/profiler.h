@@ -0,0 +1,85 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <chrono>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "intern.h"
+#include "vm.h"
+#include "parts.h"
+
+/*
+	Counts what the VM executes: calls and cumulative ticks per opcode handler
+	(the 27 bytecode opcodes plus the two video families), instructions and
+	ticks per thread (channel) and per game part.
+
+	Ticks are TSC cycles on x86 and steady_clock nanoseconds elsewhere. The
+	time spent in op_blitFramebuffer includes the frame pacing sleep, run with
+	--turbo to leave it out.
+*/
+struct VMProfiler {
+	enum {
+		NUM_OPCODE_SLOTS = VM_OPCODE_INVALID + 1,
+		NUM_PARTS = GAME_NUM_PARTS
+	};
+
+	struct Counter {
+		uint64_t count;
+		uint64_t ticks;
+	};
+
+	Counter _opcodes[NUM_OPCODE_SLOTS];
+	Counter _threads[VM_NUM_THREADS];  // count is the number of instructions
+	uint64_t _threadSlices[VM_NUM_THREADS];
+	Counter _parts[NUM_PARTS];         // count is the number of instructions
+	uint64_t _partFrames[NUM_PARTS];
+	int _curPart;
+	const char *_path;
+
+	VMProfiler(const char *path);
+
+	static uint64_t getTicks() {
+#if defined(__i386__) || defined(__x86_64__)
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	void reset();
+	void beginFrame(uint16_t partId);
+	void countOpcode(uint8_t opcode, uint64_t ticks) {
+		_opcodes[opcode].count++;
+		_opcodes[opcode].ticks += ticks;
+	}
+	void countSlice(int threadId, uint32_t instructions, uint64_t ticks);
+
+	// Writes the report to _path, as JSON when the name ends with .json.
+	void dump();
+	void writeTable(FILE *fp);
+	void writeJson(FILE *fp);
+
+	// SIGUSR1 asks for a report, written at the start of the next VM frame.
+	static void installSignalHandler();
+};
+
+#endif
@@ -0,0 +1,167 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "replay.h"
+#include "util.h"
+
+
+void InputLog::writeInput(File *f, const PlayerInput *pi) {
+	uint8_t ext = 0;
+	if (pi->lastChar != 0) {
+		ext |= EXT_CHAR;
+	}
+	if (pi->quit) {
+		ext |= EXT_QUIT;
+	}
+	if (pi->save) {
+		ext |= EXT_SAVE;
+	}
+	if (pi->load) {
+		ext |= EXT_LOAD;
+	}
+	if (pi->stateSlot != 0) {
+		ext |= EXT_SLOT;
+	}
+	uint8_t rec = pi->dirMask & REC_DIR_MASK;
+	if (pi->button) {
+		rec |= REC_BUTTON;
+	}
+	if (pi->code) {
+		rec |= REC_CODE;
+	}
+	if (pi->pause) {
+		rec |= REC_PAUSE;
+	}
+	if (ext != 0) {
+		rec |= REC_EXT;
+	}
+	f->writeByte(rec);
+	if (ext != 0) {
+		f->writeByte(ext);
+		if (ext & EXT_CHAR) {
+			f->writeByte(pi->lastChar);
+		}
+		if (ext & EXT_SLOT) {
+			f->writeByte(pi->stateSlot);
+		}
+	}
+}
+
+bool InputLog::readInput(File *f, PlayerInput *pi) {
+	uint8_t rec = f->readByte();
+	uint8_t ext = 0;
+	if (rec & REC_EXT) {
+		ext = f->readByte();
+	}
+	pi->dirMask = rec & REC_DIR_MASK;
+	pi->button = (rec & REC_BUTTON) != 0;
+	pi->code = (rec & REC_CODE) != 0;
+	pi->pause = (rec & REC_PAUSE) != 0;
+	pi->lastChar = (ext & EXT_CHAR) ? f->readByte() : 0;
+	pi->quit = (ext & EXT_QUIT) != 0;
+	pi->save = (ext & EXT_SAVE) != 0;
+	pi->load = (ext & EXT_LOAD) != 0;
+	pi->stateSlot = (ext & EXT_SLOT) ? (int8_t)f->readByte() : 0;
+	return !f->ioErr();
+}
+
+
+RecordStub::RecordStub(System *host)
+	: SystemProxy(host), _f(true), _recording(false), _framesCount(0) {
+}
+
+bool RecordStub::open(const char *filename, const char *directory, uint16_t seed) {
+	if (!_f.open(filename, directory, "wb")) {
+		warning("Unable to create input record file '%s'", filename);
+		return false;
+	}
+	_f.writeUint32BE('AWIR');
+	_f.writeUint16BE(InputLog::VERSION);
+	_f.writeUint16BE(seed);
+	_recording = true;
+	return true;
+}
+
+void RecordStub::destroy() {
+	if (_recording) {
+		_f.close();
+		_recording = false;
+		debug(DBG_INFO, "Recorded %d input frames", _framesCount);
+	}
+	SystemProxy::destroy();
+}
+
+void RecordStub::processEvents() {
+	SystemProxy::processEvents();
+	if (_recording) {
+		InputLog::writeInput(&_f, &input);
+		++_framesCount;
+		if (_f.ioErr()) {
+			warning("I/O error when writing input record, recording stopped");
+			_f.close();
+			_recording = false;
+		}
+	}
+}
+
+
+ReplayStub::ReplayStub(System *host)
+	: SystemProxy(host), _f(true), _replaying(false), _seed(0), _framesCount(0) {
+}
+
+bool ReplayStub::open(const char *filename, const char *directory) {
+	if (!_f.open(filename, directory, "rb")) {
+		warning("Unable to open input record file '%s'", filename);
+		return false;
+	}
+	if (_f.readUint32BE() != 'AWIR') {
+		warning("Bad input record format");
+		return false;
+	}
+	uint16_t ver = _f.readUint16BE();
+	if (ver != InputLog::VERSION) {
+		warning("Unsupported input record version %d", ver);
+		return false;
+	}
+	_seed = _f.readUint16BE();
+	_replaying = !_f.ioErr();
+	return _replaying;
+}
+
+void ReplayStub::destroy() {
+	_f.close();
+	SystemProxy::destroy();
+}
+
+void ReplayStub::processEvents() {
+	// The host still gets its events so the window stays responsive and the
+	// replay can be interrupted.
+	SystemProxy::processEvents();
+	const bool hostQuit = input.quit;
+	if (_replaying) {
+		if (InputLog::readInput(&_f, &input)) {
+			++_framesCount;
+		} else {
+			debug(DBG_INFO, "Replay finished after %d input frames", _framesCount);
+			_replaying = false;
+			memset(&input, 0, sizeof(input));
+			input.quit = true;
+		}
+	}
+	input.quit |= hostQuit;
+}
@@ -0,0 +1,103 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "sysProxy.h"
+#include "file.h"
+
+/*
+	Input recording and replay.
+
+	A replay file is gzipped and starts with a header:
+
+		uint32_t 'AWIR'
+		uint16_t version
+		uint16_t random seed (VM_VARIABLE_RANDOM_SEED)
+
+	followed by one record per processEvents() call, which the VM does once
+	per frame in inp_updatePlayer (and while the game is paused). A record
+	is a single byte for plain gameplay input:
+
+		bit 0-3 : dirMask
+		bit 4   : button
+		bit 5   : code
+		bit 6   : pause
+		bit 7   : an extension byte follows
+
+	The extension byte flags the rarer fields: lastChar (followed by the
+	character), quit, save, load and stateSlot (followed by the int8 value).
+*/
+struct InputLog {
+	enum {
+		VERSION = 1
+	};
+
+	enum {
+		REC_DIR_MASK = 0x0F,
+		REC_BUTTON   = 1 << 4,
+		REC_CODE     = 1 << 5,
+		REC_PAUSE    = 1 << 6,
+		REC_EXT      = 1 << 7
+	};
+
+	enum {
+		EXT_CHAR = 1 << 0,
+		EXT_QUIT = 1 << 1,
+		EXT_SAVE = 1 << 2,
+		EXT_LOAD = 1 << 3,
+		EXT_SLOT = 1 << 4
+	};
+
+	static void writeInput(File *f, const PlayerInput *pi);
+	static bool readInput(File *f, PlayerInput *pi);
+};
+
+// Writes the input the wrapped system returns, the engine sees it unchanged.
+struct RecordStub : SystemProxy {
+	File _f;
+	bool _recording;
+	uint32_t _framesCount;
+
+	RecordStub(System *host);
+	virtual ~RecordStub() {}
+
+	bool open(const char *filename, const char *directory, uint16_t seed);
+
+	virtual void destroy();
+	virtual void processEvents();
+};
+
+// Replaces the input with the recorded one and quits when the file ends.
+struct ReplayStub : SystemProxy {
+	File _f;
+	bool _replaying;
+	uint16_t _seed;
+	uint32_t _framesCount;
+
+	ReplayStub(System *host);
+	virtual ~ReplayStub() {}
+
+	bool open(const char *filename, const char *directory);
+
+	virtual void destroy();
+	virtual void processEvents();
+};
+
+#endif
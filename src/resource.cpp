@@ -18,22 +18,42 @@
 
 #include "resource.h"
 #include "bank.h"
+#include <zlib.h>
+#include <atomic>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 #include "file.h"
+#include "mapping.h"
 #include "serializer.h"
 #include "video.h"
 #include "util.h"
 #include "parts.h"
+#include "threadpool.h"
 
 Resource::Resource(Video *vid, const char *dataDir) 
-	: video(vid), _dataDir(dataDir), currentPartId(0),requestedNextPart(0) {
+	: video(vid), _dataDir(dataDir), _memListMapping(0), _cacheName(0), _cacheMapping(0), _loadPool(0), _loadListLen(0),
+	_prefetch(false), _prefetchBlock(0), _prefetchPartId(0), _prefetchListLen(0), currentPartId(0),requestedNextPart(0) {
+	memset(_bankMappings, 0, sizeof(_bankMappings));
+	memset(_cachedEntries, 0, sizeof(_cachedEntries));
 }
 
 void Resource::readBank(const MemEntry *me, uint8_t *dstBuf) {
 	uint16_t n = me - _memList;
 	debug(DBG_BANK, "Resource::readBank(%d)", n);
 
-	Bank bk(_dataDir);
-	if (!bk.read(me, dstBuf)) {
+	const FileMapping *bank = _bankMappings[me->bankId];
+	if (!bank) {
+		error("Resource::readBank() unable to open 'bank%02x'", me->bankId);
+	}
+	if (me->bankOffset + me->packedSize > bank->_size) {
+		error("Resource::readBank() entry %d is past the end of 'bank%02x'", n, me->bankId);
+	}
+
+	Bank bk;
+	if (!bk.read(me, bank->_data + me->bankOffset, dstBuf)) {
 		error("Resource::readBank() unable to unpack entry %d\n", n);
 	}
 
@@ -57,23 +77,28 @@ static const char *resTypeToString(unsigned int type)
 
 #define RES_SIZE 0
 #define RES_COMPRESSED 1
-int resourceSizeStats[7][2];
 #define STATS_TOTAL_SIZE 6
-int resourceUnitStats[7][2];
 
 /*
 	Read all entries from memlist.bin. Do not load anything in memory,
 	this is just a fast way to access the data later based on their id.
+
+	The bank files they refer to are mapped here, once: resources are then
+	read from memory, and engines of the same process share the mappings.
 */
 void Resource::readEntries() {	
-	File f;
 	int resourceCounter = 0;
+	int resourceSizeStats[7][2];
+	int resourceUnitStats[7][2];
 	
 
-	if (!f.open("memlist.bin", _dataDir)) {
+	_memListMapping = FileMapping::acquire("memlist.bin", _dataDir);
+	if (!_memListMapping) {
 		error("Resource::readEntries() unable to open 'memlist.bin' file\n");
 		//Error will exit() no need to return or do anything else.
 	}
+	const uint8_t *p = _memListMapping->_data;
+	const uint8_t *end = p + _memListMapping->_size;
 
 	//Prepare stats array
 	memset(resourceSizeStats,0,sizeof(resourceSizeStats));
@@ -83,21 +108,35 @@ void Resource::readEntries() {
 	MemEntry *memEntry = _memList;
 	while (1) {
 		assert(_numMemList < ARRAYSIZE(_memList));
-		memEntry->state = f.readByte();
-		memEntry->type = f.readByte();
-		memEntry->bufPtr = 0; f.readUint16BE();
-		memEntry->unk4 = f.readUint16BE();
-		memEntry->rankNum = f.readByte();
-		memEntry->bankId = f.readByte();
-		memEntry->bankOffset = f.readUint32BE();
-		memEntry->unkC = f.readUint16BE();
-		memEntry->packedSize = f.readUint16BE();
-		memEntry->unk10 = f.readUint16BE();
-		memEntry->size = f.readUint16BE();
-
-    if (memEntry->state == MEMENTRY_STATE_END_OF_MEMLIST) {
-      break;
-    }
+		if (p >= end || (p[0] != MEMENTRY_STATE_END_OF_MEMLIST && p + MEMENTRY_FILE_SIZE > end)) {
+			error("Resource::readEntries() 'memlist.bin' is truncated");
+		}
+		memEntry->state = p[0];
+		if (memEntry->state == MEMENTRY_STATE_END_OF_MEMLIST) {
+			break;
+		}
+		memEntry->type = p[1];
+		memEntry->bufPtr = 0;
+		memEntry->arenaPtr = 0;
+		memEntry->unk4 = READ_BE_UINT16(p + 0x4);
+		memEntry->rankNum = p[6];
+		memEntry->bankId = p[7];
+		memEntry->bankOffset = READ_BE_UINT32(p + 0x8);
+		memEntry->unkC = READ_BE_UINT16(p + 0xC);
+		memEntry->packedSize = READ_BE_UINT16(p + 0xE);
+		memEntry->unk10 = READ_BE_UINT16(p + 0x10);
+		memEntry->size = READ_BE_UINT16(p + 0x12);
+		p += MEMENTRY_FILE_SIZE;
+
+		if (memEntry->bankId != 0 && !_bankMappings[memEntry->bankId]) {
+			char bankName[10];
+			sprintf(bankName, "bank%02x", memEntry->bankId);
+			_bankMappings[memEntry->bankId] = FileMapping::acquire(bankName, _dataDir);
+			if (!_bankMappings[memEntry->bankId]) {
+				// Not fatal until one of its resources is needed.
+				warning("Resource::readEntries() unable to open '%s'", bankName);
+			}
+		}
 
 		//Memory tracking
 		if (memEntry->packedSize==memEntry->size)
@@ -158,9 +197,234 @@ void Resource::readEntries() {
 
 }
 
+void Resource::freeEntries() {
+	for (unsigned int i = 0; i < ARRAYSIZE(_bankMappings); ++i) {
+		FileMapping::release(_bankMappings[i]);
+		_bankMappings[i] = 0;
+	}
+	FileMapping::release(_memListMapping);
+	_memListMapping = 0;
+	FileMapping::release(_cacheMapping);
+	_cacheMapping = 0;
+	memset(_cachedEntries, 0, sizeof(_cachedEntries));
+	_numMemList = 0;
+	setLoadThreads(0);
+}
+
+/*
+	The resource cache keeps every entry of memlist.bin unpacked, so part
+	switches do not run Bank::unpack. It is built on the first run and
+	rebuilt when the game files change:
+
+		uint32_t 'AWRC'
+		uint16_t version
+		uint16_t number of entries
+		uint32_t crc32 of memlist.bin and of the bank files, by bankId
+		uint32_t offset, uint32_t size of each entry (0, 0 if not available)
+		payloads, aligned on CACHE_ALIGN bytes
+
+	The file is mapped: entries the game only reads (bytecode, palettes,
+	polygons, music) are used from there without a copy, the others are
+	copied to the memory block. Either way the entry keeps its place in the
+	memory block (arenaPtr), save states only refer to that.
+*/
+uint32_t Resource::getBanksChecksum() {
+	uint32_t crc = crc32(0, _memListMapping->_data, _memListMapping->_size);
+	for (unsigned int i = 0; i < ARRAYSIZE(_bankMappings); ++i) {
+		const FileMapping *m = _bankMappings[i];
+		if (m) {
+			crc = crc32(crc, m->_data, m->_size);
+		}
+	}
+	return crc;
+}
+
+void Resource::openCache(const char *directory) {
+	const uint32_t checksum = getBanksChecksum();
+	if (mapCache(directory, checksum)) {
+		return;
+	}
+	debug(DBG_INFO, "Building resource cache '%s'", _cacheName);
+	if (!buildCache(directory, checksum) || !mapCache(directory, checksum)) {
+		warning("Unable to use resource cache '%s'", _cacheName);
+	}
+}
+
+bool Resource::mapCache(const char *directory, uint32_t checksum) {
+	FileMapping *m = FileMapping::acquire(_cacheName, directory);
+	if (!m) {
+		return false;
+	}
+	const uint8_t *p = m->_data;
+	const uint32_t indexSize = CACHE_HEADER_SIZE + _numMemList * 8;
+	if (m->_size < indexSize || READ_BE_UINT32(p) != 'AWRC' || READ_BE_UINT16(p + 4) != CACHE_VERSION ||
+		READ_BE_UINT16(p + 6) != _numMemList || READ_BE_UINT32(p + 8) != checksum) {
+		debug(DBG_INFO, "Resource cache '%s' is out of date", _cacheName);
+		FileMapping::release(m);
+		return false;
+	}
+	p += CACHE_HEADER_SIZE;
+	for (int i = 0; i < _numMemList; ++i, p += 8) {
+		const uint32_t offset = READ_BE_UINT32(p);
+		const uint32_t size = READ_BE_UINT32(p + 4);
+		if (offset == 0) {
+			_cachedEntries[i] = 0;
+		} else if (size != _memList[i].size || offset < indexSize || offset > m->_size || size > m->_size - offset) {
+			warning("Resource cache '%s' entry %d is invalid", _cacheName, i);
+			memset(_cachedEntries, 0, sizeof(_cachedEntries));
+			FileMapping::release(m);
+			return false;
+		} else {
+			_cachedEntries[i] = m->_data + offset;
+		}
+	}
+	_cacheMapping = m;
+	return true;
+}
+
+bool Resource::buildCache(const char *directory, uint32_t checksum) {
+	// Written aside and renamed, a mapping of the previous file may still be
+	// in use by another engine. Each build gets its own temporary file, other
+	// engines or processes may be building the same cache at the same time.
+	static std::atomic<int> buildCount(0);
+#ifdef _WIN32
+	const int pid = _getpid();
+#else
+	const int pid = getpid();
+#endif
+	char tmpName[256];
+	snprintf(tmpName, sizeof(tmpName), "%s.%d.%d.tmp", _cacheName, pid, buildCount++);
+	File f;
+	if (!f.open(tmpName, directory, "wb")) {
+		return false;
+	}
+	f.writeUint32BE('AWRC');
+	f.writeUint16BE(CACHE_VERSION);
+	f.writeUint16BE(_numMemList);
+	f.writeUint32BE(checksum);
+	uint32_t offset = CACHE_HEADER_SIZE + _numMemList * 8;
+	for (int i = 0; i < _numMemList; ++i) {
+		const MemEntry *me = &_memList[i];
+		if (me->bankId != 0 && me->size != 0 && _bankMappings[me->bankId]) {
+			offset = (offset + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1);
+			f.writeUint32BE(offset);
+			f.writeUint32BE(me->size);
+			offset += me->size;
+		} else {
+			f.writeUint32BE(0);
+			f.writeUint32BE(0);
+		}
+	}
+	offset = CACHE_HEADER_SIZE + _numMemList * 8;
+	uint8_t *buf = (uint8_t *)malloc(0x10000);
+	for (int i = 0; i < _numMemList; ++i) {
+		const MemEntry *me = &_memList[i];
+		if (me->bankId != 0 && me->size != 0 && _bankMappings[me->bankId]) {
+			static const uint8_t padding[CACHE_ALIGN] = { 0 };
+			const uint32_t aligned = (offset + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1);
+			f.write((void *)padding, aligned - offset);
+			readBank(me, buf);
+			f.write(buf, me->size);
+			offset = aligned + me->size;
+		}
+	}
+	free(buf);
+	const bool ok = !f.ioErr();
+	f.close();
+
+	char path[512], tmpPath[512];
+	snprintf(path, sizeof(path), "%s/%s", directory, _cacheName);
+	string_lower(path + strlen(directory) + 1);
+	snprintf(tmpPath, sizeof(tmpPath), "%s/%s", directory, tmpName);
+	string_lower(tmpPath + strlen(directory) + 1);
+	if (!ok || rename(tmpPath, path) != 0) {
+		remove(tmpPath);
+		return false;
+	}
+	return true;
+}
+
+void Resource::placeEntry(MemEntry *me, uint8_t *dstBuf) {
+	const uint8_t *cached = _cachedEntries[me - _memList];
+	me->arenaPtr = dstBuf;
+	// SfxPlayer clears the loop header of instruments, sounds are copied.
+	me->bufPtr = (cached && me->type != RT_SOUND) ? (uint8_t *)cached : dstBuf;
+}
+
+/*
+	Fills the place of the entry in a memory block, unless placeEntry() made
+	it point to the resource cache. Only reads the fields of memlist.bin.
+*/
+void Resource::readEntry(const MemEntry *me, uint8_t *dstBuf) {
+	const uint8_t *cached = _cachedEntries[me - _memList];
+	if (!cached) {
+		readBank(me, dstBuf);
+	} else if (me->type == RT_SOUND) {
+		memcpy(dstBuf, cached, me->size);
+	}
+}
+
+static void readEntryTask(void *param, int task) {
+	Resource *res = (Resource *)param;
+	const MemEntry *me = res->_loadList[task];
+	res->readEntry(me, me->arenaPtr);
+}
+
+/*
+	Reads the entries of _loadList, placed beforehand: they do not overlap in
+	the memory block, so they are read and unpacked in parallel when there is
+	a pool.
+*/
+void Resource::readLoadList() {
+	if (_loadPool && _loadListLen > 1) {
+		_loadPool->run(_loadListLen, readEntryTask, this);
+	} else {
+		for (int i = 0; i < _loadListLen; ++i) {
+			readEntry(_loadList[i], _loadList[i]->arenaPtr);
+		}
+	}
+	_loadListLen = 0;
+}
+
+/*
+	numThreads <= 1 reads the entries one after the other, on the VM thread.
+*/
+void Resource::setLoadThreads(int numThreads) {
+	delete _loadPool;
+	_loadPool = 0;
+	if (numThreads > 1) {
+		_loadPool = new ThreadPool(numThreads);
+	}
+}
+
+uint8_t *Resource::toArena(uint8_t *p) {
+	for (int i = 0; i < _numMemList; ++i) {
+		const MemEntry *me = &_memList[i];
+		if (me->bufPtr != me->arenaPtr && p >= me->bufPtr && p < me->bufPtr + me->size) {
+			return me->arenaPtr + (p - me->bufPtr);
+		}
+	}
+	return p;
+}
+
+uint8_t *Resource::fromArena(uint8_t *p) {
+	for (int i = 0; i < _numMemList; ++i) {
+		const MemEntry *me = &_memList[i];
+		if (me->state == MEMENTRY_STATE_LOADED && me->bufPtr != me->arenaPtr && p >= me->arenaPtr && p < me->arenaPtr + me->size) {
+			return me->bufPtr + (p - me->arenaPtr);
+		}
+	}
+	return p;
+}
+
 /*
 	Go over every resource and check if they are marked at "MEMENTRY_STATE_LOAD_ME".
 	Load them in memory and mark them are MEMENTRY_STATE_LOADED
+
+	Entries are given their place in the memory block first, in the same
+	order as they always were (highest rankNum first), then all read at once.
+	Full screen pictures all go through _vidCurPtr, they are still read and
+	copied to the video page one at a time.
 */
 void Resource::loadMarkedAsNeeded() {
 
@@ -206,19 +470,26 @@ void Resource::loadMarkedAsNeeded() {
 			me->state = MEMENTRY_STATE_NOT_NEEDED;
 		} else {
 			debug(DBG_BANK, "Resource::load() bufPos=%X size=%X type=%X pos=%X bankId=%X", loadDestination - _memPtrStart, me->packedSize, me->type, me->bankOffset, me->bankId);
-			readBank(me, loadDestination);
 			if(me->type == RT_POLY_ANIM) {
-        video->copyPage(_vidCurPtr);
+				const uint8_t *cached = _cachedEntries[me - _memList];
+				if (cached) {
+					video->copyPage(cached);
+				} else {
+					readBank(me, loadDestination);
+					video->copyPage(_vidCurPtr);
+				}
 				me->state = MEMENTRY_STATE_NOT_NEEDED;
 			} else {
-				me->bufPtr = loadDestination;
+				placeEntry(me, loadDestination);
 				me->state = MEMENTRY_STATE_LOADED;
 				_scriptCurPtr += me->size;
+				_loadList[_loadListLen++] = me;
 			}
 		}
 
 	}
 
+	readLoadList();
 
 }
 
@@ -232,6 +503,7 @@ void Resource::invalidateRes() {
 		++me;
 	}
 	_scriptCurPtr = _scriptBakPtr;
+	video->invalidatePolygonCache();
 }
 
 void Resource::invalidateAll() {
@@ -290,6 +562,8 @@ void Resource::setupPart(uint16_t partId) {
 	uint8_t videoCinematicIndex  = memListParts[memListPartIndex][MEMLIST_PART_POLY_CINEMATIC];
 	uint8_t video2Index  = memListParts[memListPartIndex][MEMLIST_PART_VIDEO2];
 
+	const bool prefetched = takePrefetch(partId);
+
 	// Mark all resources as located on harddrive.
 	invalidateAll();
 
@@ -303,8 +577,21 @@ void Resource::setupPart(uint16_t partId) {
 		_memList[video2Index].state = MEMENTRY_STATE_LOAD_ME;
 	
 
+	if (prefetched) {
+		// Same places as loadMarkedAsNeeded() would give, already read.
+		for (int i = 0; i < _prefetchListLen; ++i) {
+			MemEntry *me = _prefetchList[i];
+			placeEntry(me, _prefetchDst[i]);
+			me->state = MEMENTRY_STATE_LOADED;
+			_scriptCurPtr += me->size;
+		}
+		_prefetchPartId = 0;
+	}
 	loadMarkedAsNeeded();
 
+	// Shapes cached from the previous part point into reused memory.
+	video->invalidatePolygonCache();
+
 	segPalettes = _memList[paletteIndex].bufPtr;
 	segBytecode     = _memList[codeIndex].bufPtr;
 	segCinematic   = _memList[videoCinematicIndex].bufPtr;
@@ -339,12 +626,120 @@ void Resource::allocMemBlock() {
 	_scriptBakPtr = _scriptCurPtr = _memPtrStart;
 	_vidBakPtr = _vidCurPtr = _memPtrStart + MEM_BLOCK_SIZE - 0x800 * 16; //0x800 = 2048, so we have 32KB free for vidBack and vidCur
 	_useSegVideo2 = false;
+	if (_prefetch) {
+		_prefetchBlock = (uint8_t *)malloc(MEM_BLOCK_SIZE);
+	}
 }
 
 void Resource::freeMemBlock() {
+	if (_prefetchThread.joinable()) {
+		_prefetchThread.join();
+	}
+	_prefetchPartId = 0;
+	free(_prefetchBlock);
+	_prefetchBlock = 0;
 	free(_memPtrStart);
 }
 
+/*
+	Lists the entries of a part in the order loadMarkedAsNeeded() loads them
+	and gives them the same places, in the memory block starting at start.
+	Returns -1 if the part has entries only the synchronous load handles.
+*/
+int Resource::planPart(uint16_t partId, uint8_t *start, MemEntry **list, uint8_t **dst) {
+	const uint16_t *part = memListParts[partId - GAME_PART_FIRST];
+	bool pending[ARRAYSIZE(_memList)];
+	memset(pending, 0, sizeof(pending));
+	pending[part[MEMLIST_PART_PALETTE]] = true;
+	pending[part[MEMLIST_PART_CODE]] = true;
+	pending[part[MEMLIST_PART_POLY_CINEMATIC]] = true;
+	if (part[MEMLIST_PART_VIDEO2] != MEMLIST_PART_NONE) {
+		pending[part[MEMLIST_PART_VIDEO2]] = true;
+	}
+	uint8_t *cur = start;
+	uint8_t *end = start + (_vidBakPtr - _memPtrStart);
+	int count = 0;
+	while (1) {
+		MemEntry *me = NULL;
+		uint8_t maxNum = 0;
+		for (int i = 0; i < _numMemList; ++i) {
+			if (pending[i] && maxNum <= _memList[i].rankNum) {
+				maxNum = _memList[i].rankNum;
+				me = &_memList[i];
+			}
+		}
+		if (me == NULL) {
+			break;
+		}
+		pending[me - _memList] = false;
+		if (me->type == RT_POLY_ANIM || me->bankId == 0 || me->size > end - cur) {
+			return -1;
+		}
+		list[count] = me;
+		dst[count] = cur;
+		++count;
+		cur += me->size;
+	}
+	return count;
+}
+
+/*
+	Starts reading the part into the second memory block, on its own thread,
+	so that setupPart() only has to swap the blocks. The prefetch of the
+	previous guess is dropped.
+*/
+void Resource::prefetchPart(uint16_t partId) {
+	if (!_prefetchBlock) {
+		return;
+	}
+	if (_prefetchThread.joinable()) {
+		_prefetchThread.join();
+	}
+	_prefetchPartId = 0;
+	if (partId == currentPartId || partId < GAME_PART_FIRST || partId > GAME_PART_LAST) {
+		return;
+	}
+	_prefetchListLen = planPart(partId, _prefetchBlock, _prefetchList, _prefetchDst);
+	if (_prefetchListLen < 0) {
+		return;
+	}
+	debug(DBG_RES, "Resource::prefetchPart(%d)", partId - GAME_PART_FIRST);
+	_prefetchPartId = partId;
+	_prefetchThread = std::thread(&Resource::runPrefetch, this, g_debugMask);
+}
+
+void Resource::runPrefetch(uint16_t debugMask) {
+	g_debugMask = debugMask;
+	for (int i = 0; i < _prefetchListLen; ++i) {
+		readEntry(_prefetchList[i], _prefetchDst[i]);
+	}
+}
+
+/*
+	Waits for the prefetch and, if it read partId, makes its memory block the
+	current one. The previous block becomes the next prefetch destination.
+*/
+bool Resource::takePrefetch(uint16_t partId) {
+	if (_prefetchThread.joinable()) {
+		_prefetchThread.join();
+	}
+	if (_prefetchPartId != partId) {
+		if (_prefetchPartId != 0) {
+			debug(DBG_INFO, "Part %d was prefetched, part %d is needed", _prefetchPartId - GAME_PART_FIRST, partId - GAME_PART_FIRST);
+			_prefetchPartId = 0;
+		}
+		return false;
+	}
+	uint8_t *prev = _memPtrStart;
+	_memPtrStart = _prefetchBlock;
+	_prefetchBlock = prev;
+	_scriptBakPtr = _memPtrStart + (_scriptBakPtr - prev);
+	_scriptCurPtr = _memPtrStart + (_scriptCurPtr - prev);
+	_vidBakPtr = _memPtrStart + (_vidBakPtr - prev);
+	_vidCurPtr = _memPtrStart + (_vidCurPtr - prev);
+	return true;
+}
+
 void Resource::saveOrLoad(Serializer &ser) {
 	uint8_t loadedList[64];
 	if (ser._mode == Serializer::SM_SAVE) {
@@ -356,7 +751,7 @@ void Resource::saveOrLoad(Serializer &ser) {
 			MemEntry *me = 0;
 			uint16_t num = _numMemList;
 			while (num--) {
-				if (it->state == MEMENTRY_STATE_LOADED && it->bufPtr == q) {
+				if (it->state == MEMENTRY_STATE_LOADED && it->arenaPtr == q) {
 					me = it;
 				}
 				++it;
@@ -369,6 +764,11 @@ void Resource::saveOrLoad(Serializer &ser) {
 				q += me->size;
 			}
 		}
+		// The save state only knows about the memory block.
+		segPalettes = toArena(segPalettes);
+		segBytecode = toArena(segBytecode);
+		segCinematic = toArena(segCinematic);
+		_segVideo2 = toArena(_segVideo2);
 	}
 
 	Serializer::Entry entries[] = {
@@ -387,15 +787,26 @@ void Resource::saveOrLoad(Serializer &ser) {
 	};
 
 	ser.saveOrLoadEntries(entries);
-	if (ser._mode == Serializer::SM_LOAD) {
+	if (ser._mode == Serializer::SM_SAVE) {
+		segPalettes = fromArena(segPalettes);
+		segBytecode = fromArena(segBytecode);
+		segCinematic = fromArena(segCinematic);
+		_segVideo2 = fromArena(_segVideo2);
+	} else {
 		uint8_t *p = loadedList;
 		uint8_t *q = _memPtrStart;
 		while (*p) {
 			MemEntry *me = &_memList[*p++];
-			readBank(me, q);
-			me->bufPtr = q;
+			placeEntry(me, q);
 			me->state = MEMENTRY_STATE_LOADED;
 			q += me->size;
+			_loadList[_loadListLen++] = me;
 		}
+		readLoadList();
+		segPalettes = fromArena(segPalettes);
+		segBytecode = fromArena(segBytecode);
+		segCinematic = fromArena(segCinematic);
+		_segVideo2 = fromArena(_segVideo2);
+		video->invalidatePolygonCache();
 	}	
 }
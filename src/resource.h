@@ -19,6 +19,7 @@
 #ifndef __RESOURCE_H__
 #define __RESOURCE_H__
 
+#include <thread>
 #include "intern.h"
 
 
@@ -27,6 +28,8 @@
 #define MEMENTRY_STATE_LOADED 1
 #define MEMENTRY_STATE_LOAD_ME 2
 
+#define MEMENTRY_FILE_SIZE 20 // bytes per entry in memlist.bin
+
 /*
     This is a directory entry. When the game starts, it loads memlist.bin and 
 	populate and array of MemEntry
@@ -45,6 +48,8 @@ struct MemEntry {
 
 	uint16_t unk10;        // 0x10, unused
 	uint16_t size; // 0x12
+
+	uint8_t *arenaPtr;     // place in the memory block, bufPtr may point to the resource cache instead
 };
 /*
      Note: state is not a boolean, it can have value 0, 1, 2 or 255, respectively meaning:
@@ -58,6 +63,8 @@ struct MemEntry {
 
 struct Serializer;
 struct Video;
+struct FileMapping;
+struct ThreadPool;
 
 struct Resource {
 
@@ -79,11 +86,35 @@ struct Resource {
 	enum {
 		MEM_BLOCK_SIZE = 600 * 1024   //600kb total memory consumed (not taking into account stack and static heap)
 	};
+
+	enum {
+		CACHE_VERSION = 1,
+		CACHE_HEADER_SIZE = 12,
+		CACHE_ALIGN = 16
+	};
 	
 	
 	Video *video;
 	const char *_dataDir;
+	FileMapping *_memListMapping;
+	FileMapping *_bankMappings[256]; // by bankId, shared with the other engines
+	const char *_cacheName; // resource cache file in the save directory, none if 0
+	FileMapping *_cacheMapping;
 	MemEntry _memList[150];
+	const uint8_t *_cachedEntries[150]; // unpacked payloads in _cacheMapping
+	ThreadPool *_loadPool; // only set up by setLoadThreads()
+	MemEntry *_loadList[150]; // placed in the memory block, not read yet
+	int _loadListLen;
+
+	// Part expected next, read in the background to a second memory block
+	// (see prefetchPart()). Only allocated if _prefetch is set before init.
+	bool _prefetch;
+	uint8_t *_prefetchBlock;
+	uint16_t _prefetchPartId; // 0 if none
+	MemEntry *_prefetchList[4];
+	uint8_t *_prefetchDst[4];
+	int _prefetchListLen;
+	std::thread _prefetchThread;
 	uint16_t _numMemList;
 	uint16_t currentPartId, requestedNextPart;
 	uint8_t *_memPtrStart, *_scriptBakPtr, *_scriptCurPtr, *_vidBakPtr, *_vidCurPtr;
@@ -98,6 +129,17 @@ struct Resource {
 	
 	void readBank(const MemEntry *me, uint8_t *dstBuf);
 	void readEntries();
+	void freeEntries();
+	uint32_t getBanksChecksum();
+	void openCache(const char *directory);
+	bool buildCache(const char *directory, uint32_t checksum);
+	bool mapCache(const char *directory, uint32_t checksum);
+	void placeEntry(MemEntry *me, uint8_t *dstBuf);
+	void readEntry(const MemEntry *me, uint8_t *dstBuf);
+	void readLoadList();
+	void setLoadThreads(int numThreads);
+	uint8_t *toArena(uint8_t *p);
+	uint8_t *fromArena(uint8_t *p);
 	void loadMarkedAsNeeded();
 	void invalidateAll();
 	void invalidateRes();	
@@ -105,6 +147,10 @@ struct Resource {
 	void setupPart(uint16_t ptrId);
 	void allocMemBlock();
 	void freeMemBlock();
+	int planPart(uint16_t partId, uint8_t *start, MemEntry **list, uint8_t **dst);
+	void prefetchPart(uint16_t partId);
+	void runPrefetch(uint16_t debugMask);
+	bool takePrefetch(uint16_t partId);
 	
 	void saveOrLoad(Serializer &ser);
 };
@@ -0,0 +1,473 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+#include "simd.h"
+
+// libc beats the vector load/store loops here, the SIMD sets fill and copy with these too.
+static void scalarFill(uint8_t *dst, uint8_t value, int len) {
+	memset(dst, value, len);
+}
+
+static void scalarCopy(uint8_t *dst, const uint8_t *src, int len) {
+	memcpy(dst, src, len);
+}
+
+/*
+	Byte loops for spanKernelsReference. GCC would otherwise turn them back
+	into memset/memcpy calls.
+*/
+#if defined(__GNUC__) && !defined(__clang__)
+#define BYTE_LOOP __attribute__((optimize("no-tree-loop-distribute-patterns")))
+#else
+#define BYTE_LOOP
+#endif
+
+BYTE_LOOP
+static void referenceFill(uint8_t *dst, uint8_t value, int len) {
+	while (len--) {
+		*dst++ = value;
+	}
+}
+
+BYTE_LOOP
+static void referenceCopy(uint8_t *dst, const uint8_t *src, int len) {
+	while (len--) {
+		*dst++ = *src++;
+	}
+}
+
+static void scalarBlend(uint8_t *dst, uint8_t andMask, uint8_t orMask, int len) {
+	while (len--) {
+		*dst = (*dst & andMask) | orMask;
+		++dst;
+	}
+}
+
+static void scalarExpand(uint32_t *dst, const uint8_t *src, int len, const PixelLut *lut) {
+#ifdef VIDEO_8BPP
+	while (len--) {
+		*dst++ = lut->colors[*src++];
+	}
+#else
+	while (len--) {
+		const uint32_t *p = lut->pairs[*src++];
+		dst[0] = p[0];
+		dst[1] = p[1];
+		dst += 2;
+	}
+#endif
+}
+
+/*
+	The bits of a plane byte spread to the pixels they belong to, bit 7 first:
+	one byte per pixel with 8bpp pages, one nibble otherwise. Merging the four
+	planes of a source byte is then three shifts and ors.
+*/
+#ifdef VIDEO_8BPP
+typedef uint64_t PlanarPixels;
+#else
+typedef uint32_t PlanarPixels;
+#endif
+
+struct PlanarLut {
+	PlanarPixels bits[256];
+
+	PlanarLut() {
+		for (int b = 0; b < 256; ++b) {
+			uint8_t px[sizeof(PlanarPixels)];
+			for (unsigned int i = 0; i < sizeof(px); ++i) {
+#ifdef VIDEO_8BPP
+				px[i] = (b >> (7 - i)) & 1;
+#else
+				px[i] = (((b >> (7 - 2 * i)) & 1) << 4) | ((b >> (6 - 2 * i)) & 1);
+#endif
+			}
+			memcpy(&bits[b], px, sizeof(px));
+		}
+	}
+};
+
+static void scalarPlanar(uint8_t *dst, const uint8_t *src, int stride, int len) {
+	// Function statics are initialized once, even with several engines starting at the same time.
+	static const PlanarLut lut;
+	for (; len != 0; --len, ++src, dst += sizeof(PlanarPixels)) {
+		const PlanarPixels px = lut.bits[src[0]] | (lut.bits[src[stride]] << 1) |
+			(lut.bits[src[2 * stride]] << 2) | (lut.bits[src[3 * stride]] << 3);
+		memcpy(dst, &px, sizeof(px));
+	}
+}
+
+/*
+	The vector planar kernels transpose the bits instead: swapping single bits
+	between planes 1/0 and 3/2, then bit pairs between 3/1 and 2/0, then
+	nibbles between 3/2 and 1/0 leaves byte k of planes 3, 1, 2 and 0 holding
+	pixels 0-1, 2-3, 4-5 and 6-7 of source byte k, as 4bpp bytes.
+*/
+
+void PixelLut::setColors(const uint32_t *argb) {
+	for (int i = 0; i < 16; ++i) {
+		colors[i] = argb[i];
+		uint8_t bytes[4];
+		memcpy(bytes, &argb[i], 4);
+		for (int k = 0; k < 4; ++k) {
+			channels[k][i] = bytes[k];
+		}
+	}
+	for (int i = 0; i < 256; ++i) {
+		pairs[i][0] = argb[i >> 4];
+		pairs[i][1] = argb[i & 15];
+	}
+}
+
+const SpanKernels spanKernelsScalar = { "scalar", scalarFill, scalarCopy, scalarBlend, scalarExpand, scalarPlanar };
+const SpanKernels spanKernelsReference = { "reference", referenceFill, referenceCopy, scalarBlend, scalarExpand, scalarPlanar };
+
+#if defined(SIMD_X86) && defined(__SSE2__)
+
+static void sse2Blend(uint8_t *dst, uint8_t andMask, uint8_t orMask, int len) {
+	const __m128i a = _mm_set1_epi8(andMask);
+	const __m128i o = _mm_set1_epi8(orMask);
+	for (; len >= 16; len -= 16, dst += 16) {
+		__m128i p = _mm_loadu_si128((const __m128i *)dst);
+		_mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(p, a), o));
+	}
+	scalarBlend(dst, andMask, orMask, len);
+}
+
+// Exchanges the bits of hi selected by mask with the bits of lo shift positions below them.
+__attribute__((always_inline))
+static inline void sse2Merge(__m128i &hi, __m128i &lo, int shift, uint8_t mask) {
+	const __m128i t = _mm_and_si128(_mm_xor_si128(_mm_srli_epi16(lo, shift), hi), _mm_set1_epi8(mask));
+	hi = _mm_xor_si128(hi, t);
+	lo = _mm_xor_si128(lo, _mm_slli_epi16(t, shift));
+}
+
+// Writes 16 4bpp bytes of planar output in the page layout.
+__attribute__((always_inline))
+static inline void sse2StorePixels(uint8_t *&dst, __m128i v) {
+#ifdef VIDEO_8BPP
+	const __m128i m = _mm_set1_epi8(0x0F);
+	const __m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+	const __m128i l = _mm_and_si128(v, m);
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(h, l));
+	_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi8(h, l));
+	dst += 32;
+#else
+	_mm_storeu_si128((__m128i *)dst, v);
+	dst += 16;
+#endif
+}
+
+static void sse2Planar(uint8_t *dst, const uint8_t *src, int stride, int len) {
+	for (; len >= 16; len -= 16, src += 16) {
+		__m128i p0 = _mm_loadu_si128((const __m128i *)src);
+		__m128i p1 = _mm_loadu_si128((const __m128i *)(src + stride));
+		__m128i p2 = _mm_loadu_si128((const __m128i *)(src + 2 * stride));
+		__m128i p3 = _mm_loadu_si128((const __m128i *)(src + 3 * stride));
+		sse2Merge(p1, p0, 1, 0x55);
+		sse2Merge(p3, p2, 1, 0x55);
+		sse2Merge(p3, p1, 2, 0x33);
+		sse2Merge(p2, p0, 2, 0x33);
+		sse2Merge(p3, p2, 4, 0x0F);
+		sse2Merge(p1, p0, 4, 0x0F);
+		const __m128i a = _mm_unpacklo_epi8(p3, p1);
+		const __m128i b = _mm_unpackhi_epi8(p3, p1);
+		const __m128i c = _mm_unpacklo_epi8(p2, p0);
+		const __m128i d = _mm_unpackhi_epi8(p2, p0);
+		sse2StorePixels(dst, _mm_unpacklo_epi16(a, c));
+		sse2StorePixels(dst, _mm_unpackhi_epi16(a, c));
+		sse2StorePixels(dst, _mm_unpacklo_epi16(b, d));
+		sse2StorePixels(dst, _mm_unpackhi_epi16(b, d));
+	}
+	scalarPlanar(dst, src, stride, len);
+}
+
+// SSE2 has no byte shuffle, the pair table is as good as it gets.
+static const SpanKernels spanKernelsSSE2 = { "sse2", scalarFill, scalarCopy, sse2Blend, scalarExpand, sse2Planar };
+
+#if defined(__GNUC__)
+#define SIMD_AVX2
+
+// The tails stay in this target too: calling the legacy-encoded SSE2 kernels
+// with the upper halves of the ymm registers dirty stalls on many CPUs.
+__attribute__((target("avx2")))
+static void avx2Blend(uint8_t *dst, uint8_t andMask, uint8_t orMask, int len) {
+	const __m256i a = _mm256_set1_epi8(andMask);
+	const __m256i o = _mm256_set1_epi8(orMask);
+	for (; len >= 32; len -= 32, dst += 32) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)dst);
+		_mm256_storeu_si256((__m256i *)dst, _mm256_or_si256(_mm256_and_si256(p, a), o));
+	}
+	if (len >= 16) {
+		__m128i p = _mm_loadu_si128((const __m128i *)dst);
+		_mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(p, _mm256_castsi256_si128(a)), _mm256_castsi256_si128(o)));
+		len -= 16;
+		dst += 16;
+	}
+	while (len--) {
+		*dst = (*dst & andMask) | orMask;
+		++dst;
+	}
+}
+
+// Looks up 16 palette indices at once, one shuffle per channel, and
+// interleaves the channels back into pixels.
+__attribute__((target("avx2")))
+static inline void avx2Expand16(uint32_t *dst, __m128i idx, const __m128i *channels) {
+	__m128i b = _mm_shuffle_epi8(channels[0], idx);
+	__m128i g = _mm_shuffle_epi8(channels[1], idx);
+	__m128i r = _mm_shuffle_epi8(channels[2], idx);
+	__m128i a = _mm_shuffle_epi8(channels[3], idx);
+	__m128i bgLo = _mm_unpacklo_epi8(b, g);
+	__m128i bgHi = _mm_unpackhi_epi8(b, g);
+	__m128i raLo = _mm_unpacklo_epi8(r, a);
+	__m128i raHi = _mm_unpackhi_epi8(r, a);
+	_mm_storeu_si128((__m128i *)(dst + 0), _mm_unpacklo_epi16(bgLo, raLo));
+	_mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(bgLo, raLo));
+	_mm_storeu_si128((__m128i *)(dst + 8), _mm_unpacklo_epi16(bgHi, raHi));
+	_mm_storeu_si128((__m128i *)(dst + 12), _mm_unpackhi_epi16(bgHi, raHi));
+}
+
+__attribute__((target("avx2")))
+static void avx2Expand(uint32_t *dst, const uint8_t *src, int len, const PixelLut *lut) {
+	__m128i channels[4];
+	for (int k = 0; k < 4; ++k) {
+		channels[k] = _mm_loadu_si128((const __m128i *)lut->channels[k]);
+	}
+#ifdef VIDEO_8BPP
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		avx2Expand16(dst, _mm_loadu_si128((const __m128i *)src), channels);
+	}
+	while (len--) {
+		*dst++ = lut->colors[*src++];
+	}
+#else
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	for (; len >= 16; len -= 16, src += 16, dst += 32) {
+		__m128i v = _mm_loadu_si128((const __m128i *)src);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+		__m128i lo = _mm_and_si128(v, nibble);
+		avx2Expand16(dst, _mm_unpacklo_epi8(hi, lo), channels);
+		avx2Expand16(dst + 16, _mm_unpackhi_epi8(hi, lo), channels);
+	}
+	while (len--) {
+		const uint32_t *p = lut->pairs[*src++];
+		dst[0] = p[0];
+		dst[1] = p[1];
+		dst += 2;
+	}
+#endif
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void avx2Merge(__m256i &hi, __m256i &lo, int shift, uint8_t mask) {
+	const __m256i t = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi16(lo, shift), hi), _mm256_set1_epi8(mask));
+	hi = _mm256_xor_si256(hi, t);
+	lo = _mm256_xor_si256(lo, _mm256_slli_epi16(t, shift));
+}
+
+// The unpacks work within 128 bit lanes, the permutes put the halves back in order.
+__attribute__((target("avx2"), always_inline))
+static inline void avx2StorePixels(uint8_t *&dst, __m256i v) {
+#ifdef VIDEO_8BPP
+	const __m256i m = _mm256_set1_epi8(0x0F);
+	const __m256i h = _mm256_and_si256(_mm256_srli_epi16(v, 4), m);
+	const __m256i l = _mm256_and_si256(v, m);
+	const __m256i lo = _mm256_unpacklo_epi8(h, l);
+	const __m256i hi = _mm256_unpackhi_epi8(h, l);
+	_mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *)(dst + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	dst += 64;
+#else
+	_mm256_storeu_si256((__m256i *)dst, v);
+	dst += 32;
+#endif
+}
+
+__attribute__((target("avx2")))
+static void avx2Planar(uint8_t *dst, const uint8_t *src, int stride, int len) {
+	for (; len >= 32; len -= 32, src += 32) {
+		__m256i p0 = _mm256_loadu_si256((const __m256i *)src);
+		__m256i p1 = _mm256_loadu_si256((const __m256i *)(src + stride));
+		__m256i p2 = _mm256_loadu_si256((const __m256i *)(src + 2 * stride));
+		__m256i p3 = _mm256_loadu_si256((const __m256i *)(src + 3 * stride));
+		avx2Merge(p1, p0, 1, 0x55);
+		avx2Merge(p3, p2, 1, 0x55);
+		avx2Merge(p3, p1, 2, 0x33);
+		avx2Merge(p2, p0, 2, 0x33);
+		avx2Merge(p3, p2, 4, 0x0F);
+		avx2Merge(p1, p0, 4, 0x0F);
+		const __m256i a = _mm256_unpacklo_epi8(p3, p1);
+		const __m256i b = _mm256_unpackhi_epi8(p3, p1);
+		const __m256i c = _mm256_unpacklo_epi8(p2, p0);
+		const __m256i d = _mm256_unpackhi_epi8(p2, p0);
+		const __m256i o0 = _mm256_unpacklo_epi16(a, c);
+		const __m256i o1 = _mm256_unpackhi_epi16(a, c);
+		const __m256i o2 = _mm256_unpacklo_epi16(b, d);
+		const __m256i o3 = _mm256_unpackhi_epi16(b, d);
+		avx2StorePixels(dst, _mm256_permute2x128_si256(o0, o1, 0x20));
+		avx2StorePixels(dst, _mm256_permute2x128_si256(o2, o3, 0x20));
+		avx2StorePixels(dst, _mm256_permute2x128_si256(o0, o1, 0x31));
+		avx2StorePixels(dst, _mm256_permute2x128_si256(o2, o3, 0x31));
+	}
+	// The tail is table based. The compiler leaves the ymm registers dirty
+	// when it turns this call into a jump, so clear them for the callers.
+	_mm256_zeroupper();
+	scalarPlanar(dst, src, stride, len);
+}
+
+static const SpanKernels spanKernelsAVX2 = { "avx2", scalarFill, scalarCopy, avx2Blend, avx2Expand, avx2Planar };
+#endif
+
+#endif
+
+#ifdef SIMD_NEON
+
+static void neonBlend(uint8_t *dst, uint8_t andMask, uint8_t orMask, int len) {
+	const uint8x16_t a = vdupq_n_u8(andMask);
+	const uint8x16_t o = vdupq_n_u8(orMask);
+	for (; len >= 16; len -= 16, dst += 16) {
+		vst1q_u8(dst, vorrq_u8(vandq_u8(vld1q_u8(dst), a), o));
+	}
+	scalarBlend(dst, andMask, orMask, len);
+}
+
+#ifdef __aarch64__
+static void neonExpand(uint32_t *dst, const uint8_t *src, int len, const PixelLut *lut) {
+	uint8x16x4_t px;
+	const uint8x16_t cb = vld1q_u8(lut->channels[0]);
+	const uint8x16_t cg = vld1q_u8(lut->channels[1]);
+	const uint8x16_t cr = vld1q_u8(lut->channels[2]);
+	const uint8x16_t ca = vld1q_u8(lut->channels[3]);
+#ifdef VIDEO_8BPP
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		uint8x16_t idx = vld1q_u8(src);
+		px.val[0] = vqtbl1q_u8(cb, idx);
+		px.val[1] = vqtbl1q_u8(cg, idx);
+		px.val[2] = vqtbl1q_u8(cr, idx);
+		px.val[3] = vqtbl1q_u8(ca, idx);
+		vst4q_u8((uint8_t *)dst, px);
+	}
+#else
+	for (; len >= 16; len -= 16, src += 16, dst += 32) {
+		uint8x16_t v = vld1q_u8(src);
+		uint8x16x2_t idx = vzipq_u8(vshrq_n_u8(v, 4), vandq_u8(v, vdupq_n_u8(0x0F)));
+		for (int i = 0; i < 2; ++i) {
+			px.val[0] = vqtbl1q_u8(cb, idx.val[i]);
+			px.val[1] = vqtbl1q_u8(cg, idx.val[i]);
+			px.val[2] = vqtbl1q_u8(cr, idx.val[i]);
+			px.val[3] = vqtbl1q_u8(ca, idx.val[i]);
+			vst4q_u8((uint8_t *)(dst + i * 16), px);
+		}
+	}
+#endif
+	scalarExpand(dst, src, len, lut);
+}
+#else
+// 32-bit NEON has no 16 entry table lookup.
+#define neonExpand scalarExpand
+#endif
+
+// Exchanges the bits of hi selected by mask with the bits of lo shift positions below them.
+__attribute__((always_inline))
+static inline void neonMerge(uint8x16_t &hi, uint8x16_t &lo, int shift, uint8_t mask) {
+	const uint8x16_t t = vandq_u8(veorq_u8(vshlq_u8(lo, vdupq_n_s8(-shift)), hi), vdupq_n_u8(mask));
+	hi = veorq_u8(hi, t);
+	lo = veorq_u8(lo, vshlq_u8(t, vdupq_n_s8(shift)));
+}
+
+static void neonPlanar(uint8_t *dst, const uint8_t *src, int stride, int len) {
+	for (; len >= 16; len -= 16, src += 16) {
+		uint8x16_t p0 = vld1q_u8(src);
+		uint8x16_t p1 = vld1q_u8(src + stride);
+		uint8x16_t p2 = vld1q_u8(src + 2 * stride);
+		uint8x16_t p3 = vld1q_u8(src + 3 * stride);
+		neonMerge(p1, p0, 1, 0x55);
+		neonMerge(p3, p2, 1, 0x55);
+		neonMerge(p3, p1, 2, 0x33);
+		neonMerge(p2, p0, 2, 0x33);
+		neonMerge(p3, p2, 4, 0x0F);
+		neonMerge(p1, p0, 4, 0x0F);
+#ifdef VIDEO_8BPP
+		const uint8x16_t m = vdupq_n_u8(0x0F);
+		const uint8x16x2_t z3 = vzipq_u8(vshrq_n_u8(p3, 4), vandq_u8(p3, m));
+		const uint8x16x2_t z1 = vzipq_u8(vshrq_n_u8(p1, 4), vandq_u8(p1, m));
+		const uint8x16x2_t z2 = vzipq_u8(vshrq_n_u8(p2, 4), vandq_u8(p2, m));
+		const uint8x16x2_t z0 = vzipq_u8(vshrq_n_u8(p0, 4), vandq_u8(p0, m));
+		for (int i = 0; i < 2; ++i) {
+			uint16x8x4_t px;
+			px.val[0] = vreinterpretq_u16_u8(z3.val[i]);
+			px.val[1] = vreinterpretq_u16_u8(z1.val[i]);
+			px.val[2] = vreinterpretq_u16_u8(z2.val[i]);
+			px.val[3] = vreinterpretq_u16_u8(z0.val[i]);
+			vst4q_u16((uint16_t *)dst, px);
+			dst += 64;
+		}
+#else
+		uint8x16x4_t px;
+		px.val[0] = p3;
+		px.val[1] = p1;
+		px.val[2] = p2;
+		px.val[3] = p0;
+		vst4q_u8(dst, px);
+		dst += 64;
+#endif
+	}
+	scalarPlanar(dst, src, stride, len);
+}
+
+static const SpanKernels spanKernelsNEON = { "neon", scalarFill, scalarCopy, neonBlend, neonExpand, neonPlanar };
+#endif
+
+static const SpanKernels *const *detectKernels() {
+	static const SpanKernels *kernels[5];
+	int n = 0;
+#ifdef SIMD_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[n++] = &spanKernelsAVX2;
+	}
+#endif
+#if defined(SIMD_X86) && defined(__SSE2__)
+	kernels[n++] = &spanKernelsSSE2;
+#endif
+#ifdef SIMD_NEON
+	kernels[n++] = &spanKernelsNEON;
+#endif
+	kernels[n++] = &spanKernelsScalar;
+	kernels[n] = 0;
+	return kernels;
+}
+
+const SpanKernels *const *span_listKernels() {
+	// Function statics are initialized once, even with several engines starting at the same time.
+	static const SpanKernels *const *kernels = detectKernels();
+	return kernels;
+}
+
+const SpanKernels *span_getKernels() {
+	return span_listKernels()[0];
+}
@@ -0,0 +1,69 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include "intern.h"
+
+/*
+	Inner loops of the polygon rasterizer: the whole bytes of a span, after
+	Video has dealt with the nibbles at its edges.
+
+	fill:   dst[i] = value
+	copy:   dst[i] = src[i]
+	blend:  dst[i] = (dst[i] & andMask) | orMask
+	expand: len bytes of a page row to ARGB8888 pixels through a PixelLut,
+	        two pixels per byte with 4bpp pages
+	planar: 8 * len pixels, in the page layout, from len bytes of each of
+	        the four bitplanes of an Amiga bitmap; plane k is at
+	        src + k * stride and holds bit k of the palette indices
+
+	spanKernelsReference does everything a byte at a time, the other sets are
+	checked against it. The scalar set is the fallback on CPUs without SIMD,
+	its fill and copy are memset and memcpy. span_getKernels() returns the
+	widest set the CPU supports (AVX2, SSE2 or NEON), detected on first call.
+*/
+/*
+	A palette ready for expand(), rebuilt by setColors() on palette changes.
+*/
+struct PixelLut {
+	uint32_t colors[16];
+	uint32_t pairs[256][2]; // a 4bpp byte to its two pixels, left one first
+	uint8_t channels[4][16]; // byte k of each color as stored in memory, for table lookup instructions
+
+	void setColors(const uint32_t *argb);
+};
+
+struct SpanKernels {
+	const char *name;
+	void (*fill)(uint8_t *dst, uint8_t value, int len);
+	void (*copy)(uint8_t *dst, const uint8_t *src, int len);
+	void (*blend)(uint8_t *dst, uint8_t andMask, uint8_t orMask, int len);
+	void (*expand)(uint32_t *dst, const uint8_t *src, int len, const PixelLut *lut);
+	void (*planar)(uint8_t *dst, const uint8_t *src, int stride, int len);
+};
+
+extern const SpanKernels spanKernelsScalar;
+extern const SpanKernels spanKernelsReference; // for bench_spans, never picked
+
+// Kernel sets built in and supported by this CPU, the best one first. Ends with NULL.
+extern const SpanKernels *const *span_listKernels();
+extern const SpanKernels *span_getKernels();
+
+#endif
@@ -55,7 +55,11 @@ const VirtualMachine::OpcodeStub VirtualMachine::opcodeTable[] = {
 	/* 0x18 */
 	&VirtualMachine::op_playSound,
 	&VirtualMachine::op_updateMemList,
-	&VirtualMachine::op_playMusic
+	&VirtualMachine::op_playMusic,
+	/* 0x1B: decoded video opcodes, see VMInstruction */
+	&VirtualMachine::op_drawCinematicPolygon,
+	&VirtualMachine::op_drawPolygon,
+	&VirtualMachine::op_invalid
 };
 
 const uint16_t VirtualMachine::frequenceTable[] = {
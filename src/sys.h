@@ -25,6 +25,43 @@
 #define NUM_COLORS 16
 #define BYTE_PER_PIXEL 3
 
+/*
+	Layout of the pages given to updateDisplay(). The game draws on a 320x200
+	screen. By default a byte holds two palette indices, the left pixel in the
+	high nibble. Built with VIDEO_8BPP each pixel gets its own byte, and
+	VIDEO_SCALE can then make the pages an integer multiple of the native
+	resolution: polygons are rasterized from their vertices at that size,
+	text, points and bitmaps are scaled up.
+*/
+#ifndef VIDEO_SCALE
+#define VIDEO_SCALE 1
+#endif
+#if VIDEO_SCALE < 1 || VIDEO_SCALE > 8
+#error "VIDEO_SCALE must be between 1 and 8"
+#endif
+#if VIDEO_SCALE > 1 && !defined(VIDEO_8BPP)
+#error "VIDEO_SCALE needs VIDEO_8BPP"
+#endif
+
+#define VID_NATIVE_WIDTH  320
+#define VID_NATIVE_HEIGHT 200
+#define VID_WIDTH  (VID_NATIVE_WIDTH * VIDEO_SCALE)
+#define VID_HEIGHT (VID_NATIVE_HEIGHT * VIDEO_SCALE)
+#ifdef VIDEO_8BPP
+#define VID_PITCH  VID_WIDTH
+#else
+#define VID_PITCH  (VID_WIDTH / 2)
+#endif
+
+/*
+	Part of a page that changed since the previous updateDisplay(), in pixels.
+	With 4bpp pages x and w are even, so a rect always covers whole bytes.
+*/
+struct DisplayRect {
+	int16_t x, y;
+	int16_t w, h;
+};
+
 struct PlayerInput {
 	enum {
 		DIR_LEFT  = 1 << 0,
@@ -58,7 +95,9 @@ struct System {
 	virtual void destroy() = 0;
 
 	virtual void setPalette(const uint8_t *buf) = 0;
-	virtual void updateDisplay(const uint8_t *buf) = 0;
+	// Only the rects need to be refreshed, the rest of buf is what was last
+	// displayed. No rects means the frame is unchanged.
+	virtual void updateDisplay(const uint8_t *buf, const DisplayRect *rects, int numRects) = 0;
 
 	virtual void processEvents() = 0;
 	virtual void sleep(uint32_t duration) = 0;
@@ -18,6 +18,7 @@
 
 #include <SDL.h>
 #include "sys.h"
+#include "simd.h"
 #include "util.h"
 
 
@@ -32,16 +33,19 @@ struct SDLStub : System {
 
 	int DEFAULT_SCALE = 3;
 
-	SDL_Surface *_screen = nullptr;
 	SDL_Window * _window = nullptr;
 	SDL_Renderer * _renderer = nullptr;
+	SDL_Texture * _texture = nullptr;
+	bool _fullRefresh = true;
 	uint8_t _scale = DEFAULT_SCALE;
+	const SpanKernels *_span = nullptr;
+	PixelLut _lut = {};
 
 	virtual ~SDLStub() {}
 	virtual void init(const char *title);
 	virtual void destroy();
 	virtual void setPalette(const uint8_t *buf);
-	virtual void updateDisplay(const uint8_t *src);
+	virtual void updateDisplay(const uint8_t *src, const DisplayRect *rects, int numRects);
 	virtual void processEvents();
 	virtual void sleep(uint32_t duration);
 	virtual uint32_t getTimeStamp();
@@ -58,6 +62,8 @@ struct SDLStub : System {
 	void prepareGfxMode();
 	void cleanupGfxMode();
 	void switchGfxMode();
+	void updateRect(const uint8_t *src, const SDL_Rect &r);
+	void present();
 };
 
 void SDLStub::init(const char *title) {
@@ -69,6 +75,7 @@ void SDLStub::init(const char *title) {
 	SDL_CaptureMouse(SDL_TRUE);
 
 	memset(&input, 0, sizeof(input));
+	_span = span_getKernels();
   _scale = DEFAULT_SCALE;
 	prepareGfxMode();
 }
@@ -78,20 +85,21 @@ void SDLStub::destroy() {
 	SDL_Quit();
 }
 
-static SDL_Color palette[NUM_COLORS];
 void SDLStub::setPalette(const uint8_t *p) {
   // The incoming palette is in 565 format.
+  uint32_t colors[NUM_COLORS];
   for (int i = 0; i < NUM_COLORS; ++i)
   {
     uint8_t c1 = *(p + 0);
     uint8_t c2 = *(p + 1);
-    palette[i].r = (((c1 & 0x0F) << 2) | ((c1 & 0x0F) >> 2)) << 2; // r
-    palette[i].g = (((c2 & 0xF0) >> 2) | ((c2 & 0xF0) >> 6)) << 2; // g
-    palette[i].b = (((c2 & 0x0F) >> 2) | ((c2 & 0x0F) << 2)) << 2; // b
-    palette[i].a = 0xFF;
+    uint8_t r = (((c1 & 0x0F) << 2) | ((c1 & 0x0F) >> 2)) << 2; // r
+    uint8_t g = (((c2 & 0xF0) >> 2) | ((c2 & 0xF0) >> 6)) << 2; // g
+    uint8_t b = (((c2 & 0x0F) >> 2) | ((c2 & 0x0F) << 2)) << 2; // b
+    colors[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
     p += 2;
   }
-  SDL_SetPaletteColors(_screen->format->palette, palette, 0, NUM_COLORS);
+  _lut.setColors(colors);
+  _fullRefresh = true;
 }
 
 void SDLStub::prepareGfxMode() {
@@ -100,39 +108,53 @@ void SDLStub::prepareGfxMode() {
 
   _window = SDL_CreateWindow("Another World", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, w * _scale, h * _scale, SDL_WINDOW_SHOWN);
   _renderer = SDL_CreateRenderer(_window, -1, 0);
-  _screen = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 8, 0, 0, 0, 0);
-  if (!_screen) {
-    error("SDLStub::prepareGfxMode() unable to allocate _screen buffer");
+  // The texture lives until the next resize, pages are expanded straight into it.
+  // The palette lookup is kept across resizes, the next frame is redrawn in full.
+  // High resolution pages are scaled down to the window by the renderer.
+  _texture = SDL_CreateTexture(_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, VID_WIDTH, VID_HEIGHT);
+  if (!_texture) {
+    error("SDLStub::prepareGfxMode() unable to allocate the screen texture");
   }
-  // Upon resize during gameplay, the screen surface is re-created and a new palette is allocated.
-  // This will result in an all-white surface palette displaying a window full of white until a
-  // a palette is set by the VM.
-  // To avoid this issue, we save the last palette locally and re-upload it each time. On game start-up this
-  // is not requested.
-  SDL_SetPaletteColors(_screen->format->palette, palette, 0, NUM_COLORS);
+  _fullRefresh = true;
 }
 
-void SDLStub::updateDisplay(const uint8_t *src) {
-  uint16_t height = SCREEN_H;
-	uint8_t* p = (uint8_t*)_screen->pixels;
-
-	//For each line
-	while (height--) {
-		//One byte gives us two pixels, we only need to iterate w/2 times.
-		for (int i = 0; i < SCREEN_W / 2; ++i) {
-			//Extract two palette indices from upper byte and lower byte.
-			p[i * 2 + 0] = *(src + i) >> 4;
-			p[i * 2 + 1] = *(src + i) & 0xF;
+void SDLStub::updateDisplay(const uint8_t *src, const DisplayRect *rects, int numRects) {
+	if (_fullRefresh) {
+		SDL_Rect r = { 0, 0, VID_WIDTH, VID_HEIGHT };
+		updateRect(src, r);
+		_fullRefresh = false;
+	} else if (numRects == 0) {
+		return;
+	} else {
+		for (int i = 0; i < numRects; ++i) {
+			SDL_Rect r = { rects[i].x, rects[i].y, rects[i].w, rects[i].h };
+			updateRect(src, r);
 		}
-		p += _screen->pitch;
-    src += SCREEN_W/2;
 	}
+	present();
+}
 
-  SDL_Texture* texture = SDL_CreateTextureFromSurface(_renderer, _screen);
-  SDL_RenderCopy(_renderer, texture, nullptr, nullptr);
-  SDL_RenderPresent(_renderer);
-  SDL_DestroyTexture(texture);
+void SDLStub::updateRect(const uint8_t *src, const SDL_Rect &r) {
+	void *pixels;
+	int pitch;
+	if (SDL_LockTexture(_texture, &r, &pixels, &pitch) != 0) {
+		return;
+	}
+	uint8_t *p = (uint8_t *)pixels;
+	src += r.y * VID_PITCH + r.x * VID_PITCH / VID_WIDTH;
+
+	//For each line, one page byte gives two pixels with 4bpp pages.
+	for (int y = 0; y < r.h; ++y) {
+		_span->expand((uint32_t *)p, src, r.w * VID_PITCH / VID_WIDTH, &_lut);
+		p += pitch;
+    src += VID_PITCH;
+	}
+	SDL_UnlockTexture(_texture);
+}
 
+void SDLStub::present() {
+  SDL_RenderCopy(_renderer, _texture, nullptr, nullptr);
+  SDL_RenderPresent(_renderer);
 }
 
 void SDLStub::processEvents() {
@@ -142,6 +164,12 @@ void SDLStub::processEvents() {
 		case SDL_QUIT:
 			input.quit = true;
 			break;
+		case SDL_WINDOWEVENT:
+			// Frames may not be presented for a while, redraw what we have.
+			if (ev.window.event == SDL_WINDOWEVENT_EXPOSED) {
+				present();
+			}
+			break;
 		case SDL_KEYUP:
 			switch(ev.key.keysym.sym) {
 			case SDLK_LEFT:
@@ -279,20 +307,20 @@ void SDLStub::unlockMutex(void *mutex) {
 
 
 void SDLStub::cleanupGfxMode() {
-	if (_screen) {
-		SDL_FreeSurface(_screen);
-    _screen = 0;
+	if (_texture) {
+		SDL_DestroyTexture(_texture);
+		_texture = nullptr;
+	}
+
+	if (_renderer) {
+		SDL_DestroyRenderer(_renderer);
+		_renderer = nullptr;
 	}
 
 	if (_window) {
 	  SDL_DestroyWindow(_window);
 	  _window = nullptr;
 	}
-
-	if (_screen) {
-	  SDL_FreeSurface(_screen);
-	  _screen = nullptr;
-	}
 }
 
 void SDLStub::switchGfxMode() {
@@ -300,6 +328,7 @@ void SDLStub::switchGfxMode() {
 	prepareGfxMode();
 }
 
-SDLStub sysImplementation;
-System *stub = &sysImplementation;
+System *System_SDL_create() {
+	return new SDLStub();
+}
 
@@ -0,0 +1,212 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "sysNull.h"
+#include "util.h"
+
+
+NullStub::NullStub()
+	: _framesCount(0), _audioRunning(false), _audioCallback(0), _audioParam(0), _audioSamplesCount(0), _nextTimerId(1) {
+	memset(_page, 0, sizeof(_page));
+	memset(_palette, 0, sizeof(_palette));
+	memset(_audioBuf, 0, sizeof(_audioBuf));
+	for (int i = 0; i < MAX_TIMERS; ++i) {
+		Timer *t = &_timers[i];
+		t->id = 0;
+		t->cancelled = false;
+		t->done = true;
+	}
+}
+
+void NullStub::init(const char *title) {
+	memset(&input, 0, sizeof(input));
+	_startTime = std::chrono::steady_clock::now();
+}
+
+void NullStub::destroy() {
+	stopAudio();
+	{
+		std::lock_guard<std::mutex> lock(_timersMutex);
+		for (int i = 0; i < MAX_TIMERS; ++i) {
+			_timers[i].cancelled = true;
+		}
+	}
+	_timersCond.notify_all();
+	for (int i = 0; i < MAX_TIMERS; ++i) {
+		if (_timers[i].thread.joinable()) {
+			_timers[i].thread.join();
+		}
+	}
+}
+
+void NullStub::setPalette(const uint8_t *buf) {
+	memcpy(_palette, buf, sizeof(_palette));
+}
+
+void NullStub::updateDisplay(const uint8_t *src, const DisplayRect *rects, int numRects) {
+	for (int i = 0; i < numRects; ++i) {
+		const DisplayRect *r = &rects[i];
+		const int offset = r->y * VID_PITCH + r->x * VID_PITCH / VID_WIDTH;
+		const int len = r->w * VID_PITCH / VID_WIDTH;
+		for (int y = 0; y < r->h; ++y) {
+			memcpy(_page + offset + y * VID_PITCH, src + offset + y * VID_PITCH, len);
+		}
+	}
+	++_framesCount;
+}
+
+void NullStub::processEvents() {
+}
+
+void NullStub::sleep(uint32_t duration) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(duration));
+}
+
+uint32_t NullStub::getTimeStamp() {
+	return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _startTime).count();
+}
+
+void NullStub::startAudio(AudioCallback callback, void *param) {
+	stopAudio();
+	_audioCallback = callback;
+	_audioParam = param;
+	_audioRunning = true;
+	_audioThread = std::thread(&NullStub::runAudio, this);
+}
+
+void NullStub::stopAudio() {
+	_audioRunning = false;
+	if (_audioThread.joinable()) {
+		_audioThread.join();
+	}
+}
+
+uint32_t NullStub::getOutputSampleRate() {
+	return SOUND_SAMPLE_RATE;
+}
+
+void NullStub::runAudio() {
+	// Pull one chunk at a time at the rate a sound device would.
+	uint8_t buf[AUDIO_CHUNK_SIZE];
+	const std::chrono::microseconds period(AUDIO_CHUNK_SIZE * 1000000LL / SOUND_SAMPLE_RATE);
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	while (_audioRunning) {
+		_audioCallback(_audioParam, buf, AUDIO_CHUNK_SIZE);
+		{
+			std::lock_guard<std::mutex> lock(_audioMutex);
+			memcpy(_audioBuf, buf, AUDIO_CHUNK_SIZE);
+			_audioSamplesCount += AUDIO_CHUNK_SIZE;
+		}
+		next += period;
+		std::this_thread::sleep_until(next);
+	}
+}
+
+int NullStub::copyLastAudio(uint8_t *dst, int len) {
+	std::lock_guard<std::mutex> lock(_audioMutex);
+	if (_audioSamplesCount == 0) {
+		return 0;
+	}
+	if (len > AUDIO_CHUNK_SIZE) {
+		len = AUDIO_CHUNK_SIZE;
+	}
+	memcpy(dst, _audioBuf + AUDIO_CHUNK_SIZE - len, len);
+	return len;
+}
+
+int NullStub::addTimer(uint32_t delay, TimerCallback callback, void *param) {
+	std::unique_lock<std::mutex> lock(_timersMutex);
+	for (int i = 0; i < MAX_TIMERS; ++i) {
+		Timer *t = &_timers[i];
+		if (t->done) {
+			if (t->thread.joinable()) {
+				// The previous owner of the slot has returned, this does not block.
+				lock.unlock();
+				t->thread.join();
+				lock.lock();
+			}
+			t->id = _nextTimerId++;
+			t->cancelled = false;
+			t->done = false;
+			t->delay = delay;
+			t->callback = callback;
+			t->param = param;
+			t->thread = std::thread(&NullStub::runTimer, this, t);
+			return t->id;
+		}
+	}
+	error("NullStub::addTimer() no free timer slot");
+	return 0;
+}
+
+void NullStub::removeTimer(int timerId) {
+	// Like SDL_RemoveTimer this does not wait for a running callback: the
+	// caller may hold a mutex the callback needs, or be the callback itself.
+	{
+		std::lock_guard<std::mutex> lock(_timersMutex);
+		for (int i = 0; i < MAX_TIMERS; ++i) {
+			if (timerId != 0 && _timers[i].id == timerId) {
+				_timers[i].cancelled = true;
+			}
+		}
+	}
+	_timersCond.notify_all();
+}
+
+void NullStub::runTimer(Timer *t) {
+	std::unique_lock<std::mutex> lock(_timersMutex);
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(t->delay);
+	for (;;) {
+		_timersCond.wait_until(lock, deadline, [t] { return t->cancelled; });
+		if (t->cancelled) {
+			break;
+		}
+		const uint32_t delay = t->delay;
+		lock.unlock();
+		uint32_t interval = t->callback(delay, t->param);
+		lock.lock();
+		if (t->cancelled || interval == 0) {
+			break;
+		}
+		t->delay = interval;
+		deadline += std::chrono::milliseconds(interval);
+	}
+	t->id = 0;
+	t->done = true;
+}
+
+void *NullStub::createMutex() {
+	// SDL mutexes are recursive, the mixer and the player rely on it.
+	return new std::recursive_mutex;
+}
+
+void NullStub::destroyMutex(void *mutex) {
+	delete (std::recursive_mutex *)mutex;
+}
+
+void NullStub::lockMutex(void *mutex) {
+	((std::recursive_mutex *)mutex)->lock();
+}
+
+void NullStub::unlockMutex(void *mutex) {
+	((std::recursive_mutex *)mutex)->unlock();
+}
+
+System *System_Null_create() {
+	return new NullStub();
+}
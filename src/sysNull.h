@@ -0,0 +1,101 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __SYS_NULL_H__
+#define __SYS_NULL_H__
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "sys.h"
+
+/*
+	NullStub is a System with no display, no sound device and no input. It
+	only needs the C++ standard library, so the engine can run on build
+	servers and benchmarks are not measuring SDL.
+
+	Presented pages, the palette and the mixed audio are kept so callers can
+	inspect what the game produced.
+*/
+struct NullStub : System {
+	enum {
+		PAGE_SIZE = VID_PITCH * VID_HEIGHT,
+		SOUND_SAMPLE_RATE = 22050,
+		AUDIO_CHUNK_SIZE = 2048,
+		MAX_TIMERS = 8
+	};
+
+	struct Timer {
+		int id;
+		bool cancelled;
+		bool done;
+		uint32_t delay;
+		TimerCallback callback;
+		void *param;
+		std::thread thread;
+	};
+
+	std::chrono::steady_clock::time_point _startTime;
+
+	uint8_t _page[PAGE_SIZE];
+	uint8_t _palette[NUM_COLORS * 2];
+	uint32_t _framesCount;
+
+	std::mutex _audioMutex;
+	std::thread _audioThread;
+	std::atomic<bool> _audioRunning;
+	AudioCallback _audioCallback;
+	void *_audioParam;
+	uint8_t _audioBuf[AUDIO_CHUNK_SIZE];
+	uint64_t _audioSamplesCount;
+
+	std::mutex _timersMutex;
+	std::condition_variable _timersCond;
+	Timer _timers[MAX_TIMERS];
+	int _nextTimerId;
+
+	NullStub();
+	virtual ~NullStub() {}
+
+	virtual void init(const char *title);
+	virtual void destroy();
+	virtual void setPalette(const uint8_t *buf);
+	virtual void updateDisplay(const uint8_t *src, const DisplayRect *rects, int numRects);
+	virtual void processEvents();
+	virtual void sleep(uint32_t duration);
+	virtual uint32_t getTimeStamp();
+	virtual void startAudio(AudioCallback callback, void *param);
+	virtual void stopAudio();
+	virtual uint32_t getOutputSampleRate();
+	virtual int addTimer(uint32_t delay, TimerCallback callback, void *param);
+	virtual void removeTimer(int timerId);
+	virtual void *createMutex();
+	virtual void destroyMutex(void *mutex);
+	virtual void lockMutex(void *mutex);
+	virtual void unlockMutex(void *mutex);
+
+	// Copies the last chunk handed out by the audio callback, returns its sample count.
+	int copyLastAudio(uint8_t *dst, int len);
+
+	void runAudio();
+	void runTimer(Timer *t);
+};
+
+#endif
@@ -0,0 +1,70 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __SYS_PROXY_H__
+#define __SYS_PROXY_H__
+
+#include "sys.h"
+
+/*
+	SystemProxy forwards every call to another System. Wrappers derive from it
+	and only override what they change (time, audio, input...).
+
+	The engine reads and writes the input of the System it was given, so the
+	proxy copies it to the host before polling events and back afterwards.
+*/
+struct SystemProxy : System {
+	System *_host;
+
+	SystemProxy(System *host)
+		: _host(host) {
+		memset(&input, 0, sizeof(input));
+	}
+	virtual ~SystemProxy() {}
+
+	virtual void init(const char *title) {
+		_host->init(title);
+		input = _host->input;
+	}
+	virtual void destroy() { _host->destroy(); }
+
+	virtual void setPalette(const uint8_t *buf) { _host->setPalette(buf); }
+	virtual void updateDisplay(const uint8_t *buf, const DisplayRect *rects, int numRects) { _host->updateDisplay(buf, rects, numRects); }
+
+	virtual void processEvents() {
+		_host->input = input;
+		_host->processEvents();
+		input = _host->input;
+	}
+	virtual void sleep(uint32_t duration) { _host->sleep(duration); }
+	virtual uint32_t getTimeStamp() { return _host->getTimeStamp(); }
+
+	virtual void startAudio(AudioCallback callback, void *param) { _host->startAudio(callback, param); }
+	virtual void stopAudio() { _host->stopAudio(); }
+	virtual uint32_t getOutputSampleRate() { return _host->getOutputSampleRate(); }
+
+	virtual int addTimer(uint32_t delay, TimerCallback callback, void *param) { return _host->addTimer(delay, callback, param); }
+	virtual void removeTimer(int timerId) { _host->removeTimer(timerId); }
+
+	virtual void *createMutex() { return _host->createMutex(); }
+	virtual void destroyMutex(void *mutex) { _host->destroyMutex(mutex); }
+	virtual void lockMutex(void *mutex) { _host->lockMutex(mutex); }
+	virtual void unlockMutex(void *mutex) { _host->unlockMutex(mutex); }
+};
+
+#endif
@@ -0,0 +1,120 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "sysTurbo.h"
+#include "util.h"
+
+
+TurboStub::TurboStub(System *host)
+	: SystemProxy(host), _clock(0), _nextTimerId(1), _audioCallback(0), _audioParam(0), _audioRate(0), _audioSamplesMixed(0) {
+	memset(_timers, 0, sizeof(_timers));
+}
+
+void TurboStub::sleep(uint32_t duration) {
+	advanceClock(duration);
+}
+
+uint32_t TurboStub::getTimeStamp() {
+	return (uint32_t)_clock;
+}
+
+void TurboStub::startAudio(AudioCallback callback, void *param) {
+	// Nothing is sent to the host sound device: samples are pulled from the
+	// mixer as the virtual clock moves forward and dropped.
+	_audioCallback = callback;
+	_audioParam = param;
+	_audioRate = getOutputSampleRate();
+	_audioSamplesMixed = _clock * _audioRate / 1000;
+}
+
+void TurboStub::stopAudio() {
+	_audioCallback = 0;
+	_audioParam = 0;
+}
+
+int TurboStub::addTimer(uint32_t delay, TimerCallback callback, void *param) {
+	for (int i = 0; i < MAX_TIMERS; ++i) {
+		Timer *t = &_timers[i];
+		if (t->id == 0) {
+			t->id = _nextTimerId++;
+			t->delay = delay;
+			t->deadline = _clock + delay;
+			t->callback = callback;
+			t->param = param;
+			return t->id;
+		}
+	}
+	error("TurboStub::addTimer() no free timer slot");
+	return 0;
+}
+
+void TurboStub::removeTimer(int timerId) {
+	for (int i = 0; i < MAX_TIMERS; ++i) {
+		if (timerId != 0 && _timers[i].id == timerId) {
+			_timers[i].id = 0;
+		}
+	}
+}
+
+void TurboStub::advanceClock(uint32_t duration) {
+	const uint64_t target = _clock + duration;
+	for (;;) {
+		// Fire the earliest timer due before the target time.
+		Timer *t = 0;
+		for (int i = 0; i < MAX_TIMERS; ++i) {
+			Timer *cur = &_timers[i];
+			if (cur->id != 0 && cur->deadline <= target && (!t || cur->deadline < t->deadline)) {
+				t = cur;
+			}
+		}
+		if (!t) {
+			break;
+		}
+		mixAudioUntil(t->deadline);
+		_clock = t->deadline;
+
+		// The callback may remove its own timer (SfxPlayer does at the end of a module).
+		const int id = t->id;
+		uint32_t interval = t->callback(t->delay, t->param);
+		if (t->id == id) {
+			if (interval == 0) {
+				t->id = 0;
+			} else {
+				t->delay = interval;
+				t->deadline += interval;
+			}
+		}
+	}
+	mixAudioUntil(target);
+	_clock = target;
+}
+
+void TurboStub::mixAudioUntil(uint64_t timeStamp) {
+	if (!_audioCallback) {
+		return;
+	}
+	const uint64_t samples = timeStamp * _audioRate / 1000;
+	while (_audioSamplesMixed < samples) {
+		uint64_t len = samples - _audioSamplesMixed;
+		if (len > AUDIO_CHUNK_SIZE) {
+			len = AUDIO_CHUNK_SIZE;
+		}
+		_audioCallback(_audioParam, _audioBuf, (int)len);
+		_audioSamplesMixed += len;
+	}
+}
@@ -0,0 +1,73 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __SYS_TURBO_H__
+#define __SYS_TURBO_H__
+
+#include "sysProxy.h"
+
+/*
+	TurboStub replaces wall-clock time with a virtual clock so the game runs as
+	fast as the host can interpret it.
+
+	sleep() advances the clock instantly instead of waiting. Timers (the SfxPlayer
+	events) and the audio callback are driven from that clock on the VM thread,
+	in timestamp order, so a run only depends on the bytecode and the input and
+	gives the same result on every machine.
+
+	Display and input still go to the host system.
+*/
+struct TurboStub : SystemProxy {
+	enum {
+		MAX_TIMERS = 8,
+		AUDIO_CHUNK_SIZE = 2048
+	};
+
+	struct Timer {
+		int id;
+		uint64_t deadline;
+		uint32_t delay;
+		TimerCallback callback;
+		void *param;
+	};
+
+	uint64_t _clock;
+	Timer _timers[MAX_TIMERS];
+	int _nextTimerId;
+
+	AudioCallback _audioCallback;
+	void *_audioParam;
+	uint32_t _audioRate;
+	uint64_t _audioSamplesMixed;
+	uint8_t _audioBuf[AUDIO_CHUNK_SIZE];
+
+	TurboStub(System *host);
+	virtual ~TurboStub() {}
+
+	virtual void sleep(uint32_t duration);
+	virtual uint32_t getTimeStamp();
+	virtual void startAudio(AudioCallback callback, void *param);
+	virtual void stopAudio();
+	virtual int addTimer(uint32_t delay, TimerCallback callback, void *param);
+	virtual void removeTimer(int timerId);
+
+	void advanceClock(uint32_t duration);
+	void mixAudioUntil(uint64_t timeStamp);
+};
+
+#endif
@@ -0,0 +1,89 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+
+#include "threadpool.h"
+#include "util.h"
+
+
+ThreadPool::ThreadPool(int numThreads)
+	: _numWorkers(numThreads > 1 ? numThreads - 1 : 0), _quit(false), _batch(0),
+	_proc(0), _param(0), _numTasks(0), _nextTask(0), _doneTasks(0) {
+	_workers = new std::thread[_numWorkers];
+	for (int i = 0; i < _numWorkers; ++i) {
+		_workers[i] = std::thread(&ThreadPool::workerLoop, this, g_debugMask);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+	}
+	_workCond.notify_all();
+	for (int i = 0; i < _numWorkers; ++i) {
+		_workers[i].join();
+	}
+	delete[] _workers;
+}
+
+void ThreadPool::run(int numTasks, TaskProc proc, void *param) {
+	std::unique_lock<std::mutex> lock(_mutex);
+	_proc = proc;
+	_param = param;
+	_numTasks = numTasks;
+	_nextTask = 0;
+	_doneTasks = 0;
+	++_batch;
+	if (_numWorkers != 0) {
+		_workCond.notify_all();
+	}
+	runTasks(lock);
+	while (_doneTasks != _numTasks) {
+		_doneCond.wait(lock);
+	}
+}
+
+// Called with the lock held, releases it while a task runs.
+void ThreadPool::runTasks(std::unique_lock<std::mutex> &lock) {
+	while (_nextTask < _numTasks) {
+		int task = _nextTask++;
+		lock.unlock();
+		_proc(_param, task);
+		lock.lock();
+		if (++_doneTasks == _numTasks) {
+			_doneCond.notify_one();
+		}
+	}
+}
+
+void ThreadPool::workerLoop(uint16_t debugMask) {
+	g_debugMask = debugMask;
+	uint32_t batch = 0;
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (1) {
+		while (!_quit && batch == _batch) {
+			_workCond.wait(lock);
+		}
+		if (_quit) {
+			break;
+		}
+		batch = _batch;
+		runTasks(lock);
+	}
+}
@@ -0,0 +1,61 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "intern.h"
+
+/*
+	A fixed set of threads running batches of independent tasks. run() hands
+	out the tasks of a batch to the workers and to the calling thread, and
+	returns once all of them are done. A pool of N threads starts N - 1
+	workers.
+*/
+struct ThreadPool {
+	typedef void (*TaskProc)(void *param, int task);
+
+	std::mutex _mutex;
+	std::condition_variable _workCond;
+	std::condition_variable _doneCond;
+	std::thread *_workers;
+	int _numWorkers;
+	bool _quit;
+
+	uint32_t _batch; // bumped by each run()
+	TaskProc _proc;
+	void *_param;
+	int _numTasks;
+	int _nextTask;
+	int _doneTasks;
+
+	ThreadPool(int numThreads);
+	~ThreadPool();
+
+	int getNumThreads() const { return _numWorkers + 1; }
+	void run(int numTasks, TaskProc proc, void *param);
+
+	void runTasks(std::unique_lock<std::mutex> &lock);
+	void workerLoop(uint16_t debugMask);
+};
+
+#endif
@@ -20,18 +20,16 @@
 #include "util.h"
 
 
-uint16_t g_debugMask;
+thread_local uint16_t g_debugMask;
 
-void debug(uint16_t cm, const char *msg, ...) {
+void debugPrint(const char *msg, ...) {
 	char buf[1024];
-	if (cm & g_debugMask) {
-		va_list va;
-		va_start(va, msg);
-		vsprintf(buf, msg, va);
-		va_end(va);
-		printf("%s\n", buf);
-		fflush(stdout);
-	}
+	va_list va;
+	va_start(va, msg);
+	vsprintf(buf, msg, va);
+	va_end(va);
+	printf("%s\n", buf);
+	fflush(stdout);
 }
 
 void error(const char *msg, ...) {
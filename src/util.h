@@ -31,9 +31,28 @@ enum {
 	DBG_RES   = 1 << 6
 };
 
-extern uint16_t g_debugMask;
+/*
+	Channels compiled in. The per-opcode and per-span channels (VM, VIDEO, SND)
+	are left out by default: their debug() calls generate no code at all.
+	Build with -DDBG_COMPILED_MASK=0xFFFF (RAW_DEBUG_CHANNELS in CMake) to get
+	them back.
+*/
+#ifndef DBG_COMPILED_MASK
+#define DBG_COMPILED_MASK (DBG_BANK | DBG_SER | DBG_INFO | DBG_RES)
+#endif
+
+// The mask of the engine running on this thread, see Engine::setDebugMask().
+extern thread_local uint16_t g_debugMask;
+
+extern void debugPrint(const char *msg, ...);
 
-extern void debug(uint16_t cm, const char *msg, ...);
+// The masks are tested inline, the arguments are only evaluated when the channel is on.
+#define debug(cm, ...) \
+	do { \
+		if (((cm) & DBG_COMPILED_MASK) && ((cm) & g_debugMask)) { \
+			debugPrint(__VA_ARGS__); \
+		} \
+	} while (0)
 extern void error(const char *msg, ...);
 extern void warning(const char *msg, ...);
 
@@ -17,53 +17,145 @@
  */
 
 #include "video.h"
+#include "simd.h"
 #include "resource.h"
 #include "serializer.h"
 #include "sys.h"
+#include "threadpool.h"
 
 
 void Polygon::readVertices(const uint8_t *p, uint16_t zoom) {
-	bbw = (*p++) * zoom / 64;
-	bbh = (*p++) * zoom / 64;
+	const uint8_t w = *p++;
+	const uint8_t h = *p++;
+	bbw = w * zoom / 64;
+	bbh = h * zoom / 64;
 	numPoints = *p++;
 	assert((numPoints & 1) == 0 && numPoints < MAX_POINTS);
 
+	// Scaling before the division keeps the fraction the native pages drop.
+	// Points are recognized at the native size, they stay 0x1.
+	if (!isPoint()) {
+		bbw = w * zoom * VIDEO_SCALE / 64;
+		bbh = h * zoom * VIDEO_SCALE / 64;
+	}
+
 	//Read all points, directly from bytecode segment
 	for (int i = 0; i < numPoints; ++i) {
 		Point *pt = &points[i];
-		pt->x = (*p++) * zoom / 64;
-		pt->y = (*p++) * zoom / 64;
+		pt->x = (*p++) * zoom * VIDEO_SCALE / 64;
+		pt->y = (*p++) * zoom * VIDEO_SCALE / 64;
+	}
+}
+
+void PolygonCache::clear() {
+	memset(_shapes, 0, sizeof(_shapes));
+	_numShapes = 0;
+	_numItems = 0;
+	_numVertices = 0;
+}
+
+// Returns the slot of the shape, or the empty slot where it is to be recorded.
+PolygonCache::Shape *PolygonCache::lookup(const uint8_t *buf, uint16_t offset, uint16_t zoom) {
+	uint32_t h = ((uint32_t)offset * 0x9E3779B1u) ^ ((uint32_t)zoom * 0x85EBCA77u) ^ (uint32_t)(uintptr_t)buf;
+	h ^= h >> 15;
+	for (uint32_t i = h & (MAX_SHAPES - 1); ; i = (i + 1) & (MAX_SHAPES - 1)) {
+		Shape *shape = &_shapes[i];
+		if (shape->buf == 0 || (shape->buf == buf && shape->offset == offset && shape->zoom == zoom)) {
+			return shape;
+		}
+	}
+}
+
+PolygonCache::Item *PolygonCache::addPolygon(uint8_t numPoints) {
+	if (_numItems == MAX_POLYGONS || numPoints > MAX_VERTICES - _numVertices) {
+		return 0;
+	}
+	Item *item = &_items[_numItems++];
+	item->poly.numPoints = numPoints;
+	item->poly.points = &_vertices[_numVertices];
+	_numVertices += numPoints;
+	return item;
+}
+
+void PageDamage::clear() {
+	for (int y = 0; y < VID_HEIGHT; ++y) {
+		x1[y] = VID_WIDTH;
+		x2[y] = -1;
+	}
+}
+
+void PageDamage::markAll() {
+	markRows(0, VID_HEIGHT - 1);
+}
+
+void PageDamage::markRows(int16_t y1, int16_t y2) {
+	for (int y = y1; y <= y2; ++y) {
+		x1[y] = 0;
+		x2[y] = VID_WIDTH - 1;
+	}
+}
+
+void PageDamage::add(const PageDamage &d) {
+	for (int y = 0; y < VID_HEIGHT; ++y) {
+		if (d.x1[y] < x1[y]) x1[y] = d.x1[y];
+		if (d.x2[y] > x2[y]) x2[y] = d.x2[y];
 	}
 }
 
 Video::Video(Resource *resParameter, System *stub) 
-	: res(resParameter), sys(stub) {
+	: res(resParameter), sys(stub), _polyCache(0), _rasterPool(0), _numRasterBands(0),
+	_rasterQueue(0), _rasterQueueLen(0) {
 }
 
 void Video::init() {
 
 	paletteIdRequested = NO_PALETTE_CHANGE_REQUESTED;
 
-	uint8_t* tmp = (uint8_t *)malloc(4 * VID_PAGE_SIZE);
-	memset(tmp,0,4 * VID_PAGE_SIZE);
+	uint8_t* tmp = (uint8_t *)malloc(NUM_BUFFERS * VID_PAGE_SIZE);
+	memset(tmp,0,NUM_BUFFERS * VID_PAGE_SIZE);
 	
+	for (int i = 0; i < NUM_BUFFERS; ++i) {
+		_buffers[i] = tmp + i * VID_PAGE_SIZE;
+		_bufferRefs[i] = 0;
+	}
 	for (int i = 0; i < 4; ++i) {
-    _pages[i] = tmp + i * VID_PAGE_SIZE;
+		_bufferRefs[i] = 1;
+		_pageBuffers[i] = i;
+		_pages[i] = _buffers[i];
+		// Nothing is known about the screen yet.
+		_damage[i].markAll();
 	}
 
-	_curPagePtr3 = getPage(1);
-	_curPagePtr2 = getPage(2);
+	_curPage3 = getPage(1);
+	_curPage2 = getPage(2);
 
 
 	changePagePtr1(0xFE);
 
-	_interpTable[0] = 0x4000;
+	_interpTable[0] = 0x10000;
+
+	_span = span_getKernels();
 
-	for (int i = 1; i < 0x400; ++i) {
-		_interpTable[i] = 0x4000 / i;
+	_polyCache = (PolygonCache *)malloc(sizeof(PolygonCache));
+	_polyCache->clear();
+
+	// The original table held 0x4000 / i, multiplied by 4 by calcStep. Native
+	// pages keep that rounding, the taller edges of scaled pages need the bits.
+	for (int i = 1; i < 0x400 * VIDEO_SCALE; ++i) {
+		_interpTable[i] = 0x10000 / i;
+		if (VIDEO_SCALE == 1) {
+			_interpTable[i] &= ~3;
+		}
 	}
 }
 
+void Video::free() {
+	setRasterThreads(0);
+	::free(_buffers[0]);
+	::free(_polyCache);
+	_polyCache = 0;
+}
+
 /*
 	This
 */
@@ -82,64 +174,157 @@ void Video::setDataBuffer(uint8_t *dataBuf, uint16_t offset) {
 	 This is a recursive function. */
 void Video::readAndDrawPolygon(uint8_t color, uint16_t zoom, const Point &pt) {
 
+	const Point origin(pt.x * VIDEO_SCALE, pt.y * VIDEO_SCALE);
+
+	uint16_t offset = _pData.pc - _dataBuf;
+	PolygonCache::Shape *shape = _polyCache->lookup(_dataBuf, offset, zoom);
+
+	if (shape->buf == 0) {
+		// Keep a quarter of the slots free so probing stays short.
+		if (_polyCache->_numShapes >= PolygonCache::MAX_SHAPES * 3 / 4) {
+			invalidatePolygonCache();
+			shape = _polyCache->lookup(_dataBuf, offset, zoom);
+		}
+		uint16_t firstPolygon = _polyCache->_numItems;
+		if (!readPolygon(color, zoom, Point(0, 0), true)) {
+			// Out of room, start over from an empty cache.
+			invalidatePolygonCache();
+			_pData.pc = _dataBuf + offset;
+			shape = _polyCache->lookup(_dataBuf, offset, zoom);
+			firstPolygon = 0;
+			if (!readPolygon(color, zoom, Point(0, 0), true)) {
+				error("Video::readAndDrawPolygon() shape 0x%X does not fit in the polygon cache", offset);
+			}
+		}
+		shape->buf = _dataBuf;
+		shape->offset = offset;
+		shape->zoom = zoom;
+		shape->firstPolygon = firstPolygon;
+		shape->numPolygons = _polyCache->_numItems - firstPolygon;
+		++_polyCache->_numShapes;
+	}
+
+	const PolygonCache::Item *item = &_polyCache->_items[shape->firstPolygon];
+	for (int n = shape->numPolygons; n != 0; --n, ++item) {
+		uint8_t c = item->color;
+		if (item->callerColor && !(color & 0x80)) {
+			c = color;
+		}
+		fillPolygon(c, item->poly, Point(origin.x + item->pos.x, origin.y + item->pos.y));
+	}
+}
+
+/*  Decodes the shape at _pData.pc into the polygon cache, in drawing order.
+	pos is relative to the origin of the shape being cached. Returns false
+	when the cache is full. */
+bool Video::readPolygon(uint8_t color, uint16_t zoom, const Point &pos, bool root) {
+
 	uint8_t i = _pData.fetchByte();
 
 	//This is 
 	if (i >= 0xC0) {	// 0xc0 = 192
 
+		PolygonCache::Item *item = _polyCache->addPolygon(_pData.pc[2]);
+		if (!item) {
+			return false;
+		}
+		item->pos = pos;
+		item->callerColor = root;
+
 		// WTF ?
-		if (color & 0x80) {   //0x80 = 128 (1000 0000)
+		if (root || (color & 0x80)) {   //0x80 = 128 (1000 0000)
 			color = i & 0x3F; //0x3F =  63 (0011 1111)   
 		}
+		item->color = color;
 
 		// pc is misleading here since we are not reading bytecode but only
 		// vertices informations.
-		polygon.readVertices(_pData.pc, zoom);
-
-		fillPolygon(color, zoom, pt);
-
-
+		item->poly.readVertices(_pData.pc, zoom);
 
 	} else {
 		i &= 0x3F;  //0x3F = 63
 		if (i == 1) {
 			warning("Video::readAndDrawPolygon() ec=0x%X (i != 2)", 0xF80);
 		} else if (i == 2) {
-			readAndDrawPolygonHierarchy(zoom, pt);
+			return readPolygonHierarchy(zoom, pos);
 
 		} else {
 			warning("Video::readAndDrawPolygon() ec=0x%X (i != 2)", 0xFBB);
 		}
 	}
 
+	return true;
+}
 
+void Video::fillPolygon(uint16_t color, const Polygon &poly, const Point &pt) {
 
+	if (!_rasterPool) {
+		prepareWorkPage();
+		rasterPolygon(color, poly, pt, 0, VID_HEIGHT - 1);
+		return;
+	}
+
+	// Rows the rasterizer will walk: from the top of the bounding box down
+	// the edges of the right chain.
+	int32_t y1, y2;
+	if (poly.isPoint()) {
+		y1 = pt.y;
+		y2 = pt.y + VIDEO_SCALE - 1;
+	} else {
+		y1 = pt.y - poly.bbh / 2;
+		y2 = y1 - 1;
+		for (int i = 1; i < poly.numPoints / 2; ++i) {
+			y2 += (uint16_t)(poly.points[i].y - poly.points[i - 1].y);
+		}
+	}
+	if (y1 < 0) y1 = 0;
+	if (y2 > VID_HEIGHT - 1) y2 = VID_HEIGHT - 1;
+	if (y1 > y2) {
+		return;
+	}
+
+	if (_rasterQueueLen == MAX_RASTER_COMMANDS) {
+		flushRaster();
+	}
+	RasterCommand *cmd = &_rasterQueue[_rasterQueueLen++];
+	cmd->poly = poly;
+	cmd->pt = pt;
+	cmd->color = color;
+	cmd->y1 = y1;
+	cmd->y2 = y2;
 }
 
-void Video::fillPolygon(uint16_t color, uint16_t zoom, const Point &pt) {
+/*
+	Fills the rows yMin..yMax of a polygon, the others are only stepped over.
+*/
+void Video::rasterPolygon(uint16_t color, const Polygon &poly, const Point &pt, int16_t yMin, int16_t yMax) {
 
-	if (polygon.bbw == 0 && polygon.bbh == 1 && polygon.numPoints == 4) {
-		drawPoint(color, pt.x, pt.y);
+	if (poly.isPoint()) {
+		for (int16_t y = MAX(pt.y, yMin); y <= MIN(pt.y + VIDEO_SCALE - 1, yMax); ++y) {
+			for (int16_t x = pt.x; x < pt.x + VIDEO_SCALE; ++x) {
+				drawPoint(color, x, y);
+			}
+		}
 
 		return;
 	}
 	
-	int16_t x1 = pt.x - polygon.bbw / 2;
-	int16_t x2 = pt.x + polygon.bbw / 2;
-	int16_t y1 = pt.y - polygon.bbh / 2;
-	int16_t y2 = pt.y + polygon.bbh / 2;
+	int16_t x1 = pt.x - poly.bbw / 2;
+	int16_t x2 = pt.x + poly.bbw / 2;
+	int16_t y1 = pt.y - poly.bbh / 2;
+	int16_t y2 = pt.y + poly.bbh / 2;
 
-	if (x1 > 319 || x2 < 0 || y1 > 199 || y2 < 0)
+	if (x1 > VID_WIDTH - 1 || x2 < 0 || y1 > yMax || y2 < yMin)
 		return;
 
-	_hliney = y1;
+	int16_t hliney = y1;
 	
 	uint16_t i, j;
 	i = 0;
-	j = polygon.numPoints - 1;
+	j = poly.numPoints - 1;
 	
-	x2 = polygon.points[i].x + x1;
-	x1 = polygon.points[j].x + x1;
+	x2 = poly.points[i].x + x1;
+	x1 = poly.points[j].x + x1;
 
 	++i;
 	--j;
@@ -153,17 +338,18 @@ void Video::fillPolygon(uint16_t color, uint16_t zoom, const Point &pt) {
 		drawFct = &Video::drawLineBlend;
 	}
 
+	uint8_t numPoints = poly.numPoints;
 	uint32_t cpt1 = x1 << 16;
 	uint32_t cpt2 = x2 << 16;
 
 	while (1) {
-		polygon.numPoints -= 2;
-		if (polygon.numPoints == 0) {
+		numPoints -= 2;
+		if (numPoints == 0) {
 			break;
 		}
 		uint16_t h;
-		int32_t step1 = calcStep(polygon.points[j + 1], polygon.points[j], h);
-		int32_t step2 = calcStep(polygon.points[i - 1], polygon.points[i], h);
+		int32_t step1 = calcStep(poly.points[j + 1], poly.points[j], h);
+		int32_t step2 = calcStep(poly.points[i - 1], poly.points[i], h);
 
 		++i;
 		--j;
@@ -176,19 +362,19 @@ void Video::fillPolygon(uint16_t color, uint16_t zoom, const Point &pt) {
 			cpt2 += step2;
 		} else {
 			for (; h != 0; --h) {
-				if (_hliney >= 0) {
+				if (hliney >= yMin) {
 					x1 = cpt1 >> 16;
 					x2 = cpt2 >> 16;
-					if (x1 <= 319 && x2 >= 0) {
+					if (x1 <= VID_WIDTH - 1 && x2 >= 0) {
 						if (x1 < 0) x1 = 0;
-						if (x2 > 319) x2 = 319;
-						(this->*drawFct)(x1, x2, color);
+						if (x2 > VID_WIDTH - 1) x2 = VID_WIDTH - 1;
+						(this->*drawFct)(x1, x2, hliney, color);
 					}
 				}
 				cpt1 += step1;
 				cpt2 += step2;
-				++_hliney;					
-				if (_hliney > 199) return;
+				++hliney;					
+				if (hliney > yMax) return;
 			}
 		}
 	}
@@ -197,28 +383,97 @@ void Video::fillPolygon(uint16_t color, uint16_t zoom, const Point &pt) {
 
 
 
+}
+
+/*
+	numThreads <= 0 fills polygons as they are drawn, on the VM thread. Otherwise
+	the page is split in as many bands as threads.
+*/
+void Video::setRasterThreads(int numThreads) {
+	if (_rasterPool) {
+		flushRaster();
+		delete _rasterPool;
+		_rasterPool = 0;
+		::free(_rasterQueue);
+		_rasterQueue = 0;
+		for (int i = 0; i < _numRasterBands; ++i) {
+			::free(_rasterBins[i]);
+		}
+		_numRasterBands = 0;
+	}
+	if (numThreads > 0) {
+		if (numThreads > MAX_RASTER_THREADS) {
+			numThreads = MAX_RASTER_THREADS;
+		}
+		_rasterPool = new ThreadPool(numThreads);
+		_numRasterBands = numThreads;
+		_rasterQueue = (RasterCommand *)malloc(MAX_RASTER_COMMANDS * sizeof(RasterCommand));
+		_rasterQueueLen = 0;
+		for (int i = 0; i < _numRasterBands; ++i) {
+			_rasterBins[i] = (uint16_t *)malloc(MAX_RASTER_COMMANDS * sizeof(uint16_t));
+		}
+	}
+}
+
+static void rasterBandTask(void *param, int band) {
+	((Video *)param)->rasterBand(band);
+}
+
+/*
+	Bins the queued polygons by band and fills the bands in parallel. A band
+	sees its polygons in the order they were drawn, blends and copies from
+	page 0 only read rows of the band itself.
+*/
+void Video::flushRaster() {
+	if (_rasterQueueLen == 0) {
+		return;
+	}
+	for (int b = 0; b < _numRasterBands; ++b) {
+		_rasterBinLen[b] = 0;
+	}
+	prepareWorkPage();
+	for (int i = 0; i < _rasterQueueLen; ++i) {
+		const RasterCommand *cmd = &_rasterQueue[i];
+		int b1 = cmd->y1 * _numRasterBands / VID_HEIGHT;
+		int b2 = cmd->y2 * _numRasterBands / VID_HEIGHT;
+		for (int b = b1; b <= b2; ++b) {
+			_rasterBins[b][_rasterBinLen[b]++] = i;
+		}
+	}
+	_rasterPool->run(_numRasterBands, rasterBandTask, this);
+	_rasterQueueLen = 0;
+}
+
+void Video::rasterBand(int band) {
+	// The rows y with y * bands / VID_HEIGHT == band, as used for binning.
+	int16_t yMin = (band * VID_HEIGHT + _numRasterBands - 1) / _numRasterBands;
+	int16_t yMax = ((band + 1) * VID_HEIGHT + _numRasterBands - 1) / _numRasterBands - 1;
+	for (int i = 0; i < _rasterBinLen[band]; ++i) {
+		const RasterCommand *cmd = &_rasterQueue[_rasterBins[band][i]];
+		rasterPolygon(cmd->color, cmd->poly, cmd->pt, MAX(yMin, cmd->y1), MIN(yMax, cmd->y2));
+	}
 }
 
 /*
     What is read from the bytecode is not a pure screnspace polygon but a polygonspace polygon.
 
 */
-void Video::readAndDrawPolygonHierarchy(uint16_t zoom, const Point &pgc) {
+bool Video::readPolygonHierarchy(uint16_t zoom, const Point &pgc) {
 
 	Point pt(pgc);
-	pt.x -= _pData.fetchByte() * zoom / 64;
-	pt.y -= _pData.fetchByte() * zoom / 64;
+	pt.x -= _pData.fetchByte() * zoom * VIDEO_SCALE / 64;
+	pt.y -= _pData.fetchByte() * zoom * VIDEO_SCALE / 64;
 
 	int16_t childs = _pData.fetchByte();
-	debug(DBG_VIDEO, "Video::readAndDrawPolygonHierarchy childs=%d", childs);
+	debug(DBG_VIDEO, "Video::readPolygonHierarchy childs=%d", childs);
 
 	for ( ; childs >= 0; --childs) {
 
 		uint16_t off = _pData.fetchWord();
 
 		Point po(pt);
-		po.x += _pData.fetchByte() * zoom / 64;
-		po.y += _pData.fetchByte() * zoom / 64;
+		po.x += _pData.fetchByte() * zoom * VIDEO_SCALE / 64;
+		po.y += _pData.fetchByte() * zoom * VIDEO_SCALE / 64;
 
 		uint16_t color = 0xFF;
 		uint16_t _bp = off;
@@ -233,22 +488,34 @@ void Video::readAndDrawPolygonHierarchy(uint16_t zoom, const Point &pgc) {
 		_pData.pc = _dataBuf + off * 2;
 
 
-		readAndDrawPolygon(color, zoom, po);
+		bool fits = readPolygon(color, zoom, po, false);
 
 
 		_pData.pc = bak;
+		if (!fits) {
+			return false;
+		}
 	}
 
-	
+	return true;
+}
+
+void Video::invalidatePolygonCache() {
+	// Queued polygons point to the cached vertices.
+	flushRaster();
+	debug(DBG_VIDEO, "Video::invalidatePolygonCache() shapes=%d polygons=%d", _polyCache->_numShapes, _polyCache->_numItems);
+	_polyCache->clear();
 }
 
 int32_t Video::calcStep(const Point &p1, const Point &p2, uint16_t &dy) {
 	dy = p2.y - p1.y;
-	return (p2.x - p1.x) * _interpTable[dy] * 4;
+	return (p2.x - p1.x) * (int32_t)_interpTable[dy];
 }
 
 void Video::drawString(uint8_t color, uint16_t x, uint16_t y, uint16_t stringId) {
 
+	flushRaster();
+
 	const StrEntry *se = _stringsTableEng;
 
 	//Search for the location where the string is located.
@@ -261,6 +528,7 @@ void Video::drawString(uint8_t color, uint16_t x, uint16_t y, uint16_t stringId)
 	if (se->id == END_OF_STRING_DICTIONARY)
 		return;
 	
+	prepareWorkPage();
 
     //Used if the string contains a return carriage.
 	uint16_t xOrigin = x;
@@ -273,18 +541,37 @@ void Video::drawString(uint8_t color, uint16_t x, uint16_t y, uint16_t stringId)
 			continue;
 		} 
 		
-		drawChar(se->str[i], x, y, color, _curPagePtr1);
+		drawChar(se->str[i], x, y, color);
 		x++;
 		
 	}
 }
 
-void Video::drawChar(uint8_t character, uint16_t x, uint16_t y, uint8_t color, uint8_t *buf) {
+void Video::drawChar(uint8_t character, uint16_t x, uint16_t y, uint8_t color) {
 	if (x <= 39 && y <= 192) {
 		
 		const uint8_t *ft = _font + (character - ' ') * 8;
 
-		uint8_t *p = buf + x * 4 + y * 160;
+		// A glyph bit covers VIDEO_SCALE x VIDEO_SCALE page pixels.
+		enum { CHAR_SIZE = 8 * VIDEO_SCALE };
+		for (int j = 0; j < CHAR_SIZE; ++j) {
+			_curDamage1->mark(y * VIDEO_SCALE + j, x * CHAR_SIZE, x * CHAR_SIZE + CHAR_SIZE - 1);
+		}
+
+#ifdef VIDEO_8BPP
+		uint8_t *p = _curPagePtr1 + (x * 8 + y * VID_PITCH) * VIDEO_SCALE;
+
+		for (int j = 0; j < CHAR_SIZE; ++j) {
+			uint8_t ch = *(ft + j / VIDEO_SCALE);
+			for (int i = 0; i < CHAR_SIZE; ++i) {
+				if (ch & (0x80 >> (i / VIDEO_SCALE))) {
+					*(p + i) = color & 0xF;
+				}
+			}
+			p += VID_PITCH;
+		}
+#else
+		uint8_t *p = _curPagePtr1 + x * 4 + y * 160;
 
 		for (int j = 0; j < 8; ++j) {
 			uint8_t ch = *(ft + j);
@@ -306,12 +593,27 @@ void Video::drawChar(uint8_t character, uint16_t x, uint16_t y, uint8_t color, u
 			}
 			p += 160;
 		}
+#endif
 	}
 }
 
 void Video::drawPoint(uint8_t color, int16_t x, int16_t y) {
 	debug(DBG_VIDEO, "drawPoint(%d, %d, %d)", color, x, y);
-	if (x >= 0 && x <= 319 && y >= 0 && y <= 199) {
+	if (x >= 0 && x <= VID_WIDTH - 1 && y >= 0 && y <= VID_HEIGHT - 1) {
+		_curDamage1->mark(y, x, x);
+#ifdef VIDEO_8BPP
+		uint32_t off = y * VID_PITCH + x;
+
+		if (color == 0x10) {
+			*(_curPagePtr1 + off) |= 0x8;
+		} else if (color == 0x11) {
+			*(_curPagePtr1 + off) = *(_pages[0] + off);
+		} else {
+			// Same nibble the 4bpp code keeps from (color << 4) | color.
+			uint8_t colb = ((x / VIDEO_SCALE) & 1) ? color : ((color << 4) | color) >> 4;
+			*(_curPagePtr1 + off) = colb & 0xF;
+		}
+#else
 		uint16_t off = y * 160 + x / 2;
 	
 		uint8_t cmasko, cmaskn;
@@ -333,16 +635,21 @@ void Video::drawPoint(uint8_t color, int16_t x, int16_t y) {
 		}
 		uint8_t b = *(_curPagePtr1 + off);
 		*(_curPagePtr1 + off) = (b & cmasko) | (colb & cmaskn);
+#endif
 	}
 }
 
 /* Blend a line in the current framebuffer (_curPagePtr1)
 */
-void Video::drawLineBlend(int16_t x1, int16_t x2, uint8_t color) {
-	debug(DBG_VIDEO, "drawLineBlend(%d, %d, %d)", x1, x2, color);
+void Video::drawLineBlend(int16_t x1, int16_t x2, int16_t y, uint8_t color) {
+	debug(DBG_VIDEO, "drawLineBlend(%d, %d, %d, %d)", x1, x2, y, color);
 	int16_t xmax = MAX(x1, x2);
 	int16_t xmin = MIN(x1, x2);
-	uint8_t *p = _curPagePtr1 + _hliney * 160 + xmin / 2;
+	_curDamage1->mark(y, xmin, xmax);
+#ifdef VIDEO_8BPP
+	_span->blend(_curPagePtr1 + y * VID_PITCH + xmin, 0xFF, 0x08, xmax - xmin + 1);
+#else
+	uint8_t *p = _curPagePtr1 + y * 160 + xmin / 2;
 
 	uint16_t w = xmax / 2 - xmin / 2 + 1;
 	uint8_t cmaske = 0;
@@ -360,23 +667,26 @@ void Video::drawLineBlend(int16_t x1, int16_t x2, uint8_t color) {
 		*p = (*p & cmasks) | 0x08;
 		++p;
 	}
-	while (w--) {
-		*p = (*p & 0x77) | 0x88;
-		++p;
-	}
+	_span->blend(p, 0x77, 0x88, w);
+	p += w;
 	if (cmaske != 0) {
 		*p = (*p & cmaske) | 0x80;
 		++p;
 	}
+#endif
 
 
 }
 
-void Video::drawLineN(int16_t x1, int16_t x2, uint8_t color) {
-	debug(DBG_VIDEO, "drawLineN(%d, %d, %d)", x1, x2, color);
+void Video::drawLineN(int16_t x1, int16_t x2, int16_t y, uint8_t color) {
+	debug(DBG_VIDEO, "drawLineN(%d, %d, %d, %d)", x1, x2, y, color);
 	int16_t xmax = MAX(x1, x2);
 	int16_t xmin = MIN(x1, x2);
-	uint8_t *p = _curPagePtr1 + _hliney * 160 + xmin / 2;
+	_curDamage1->mark(y, xmin, xmax);
+#ifdef VIDEO_8BPP
+	_span->fill(_curPagePtr1 + y * VID_PITCH + xmin, color & 0xF, xmax - xmin + 1);
+#else
+	uint8_t *p = _curPagePtr1 + y * 160 + xmin / 2;
 
 	uint16_t w = xmax / 2 - xmin / 2 + 1;
 	uint8_t cmaske = 0;
@@ -395,22 +705,27 @@ void Video::drawLineN(int16_t x1, int16_t x2, uint8_t color) {
 		*p = (*p & cmasks) | (colb & 0x0F);
 		++p;
 	}
-	while (w--) {
-		*p++ = colb;
-	}
+	_span->fill(p, colb, w);
+	p += w;
 	if (cmaske != 0) {
 		*p = (*p & cmaske) | (colb & 0xF0);
 		++p;		
 	}
+#endif
 
 	
 }
 
-void Video::drawLineP(int16_t x1, int16_t x2, uint8_t color) {
-	debug(DBG_VIDEO, "drawLineP(%d, %d, %d)", x1, x2, color);
+void Video::drawLineP(int16_t x1, int16_t x2, int16_t y, uint8_t color) {
+	debug(DBG_VIDEO, "drawLineP(%d, %d, %d, %d)", x1, x2, y, color);
 	int16_t xmax = MAX(x1, x2);
 	int16_t xmin = MIN(x1, x2);
-	uint16_t off = _hliney * 160 + xmin / 2;
+	_curDamage1->mark(y, xmin, xmax);
+#ifdef VIDEO_8BPP
+	uint32_t off = y * VID_PITCH + xmin;
+	_span->copy(_curPagePtr1 + off, _pages[0] + off, xmax - xmin + 1);
+#else
+	uint16_t off = y * 160 + xmin / 2;
 	uint8_t *p = _curPagePtr1 + off;
 	uint8_t *q = _pages[0] + off;
 
@@ -431,31 +746,32 @@ void Video::drawLineP(int16_t x1, int16_t x2, uint8_t color) {
 		++p;
 		++q;
 	}
-	while (w--) {
-		*p++ = *q++;			
-	}
+	_span->copy(p, q, w);
+	p += w;
+	q += w;
 	if (cmaske != 0) {
 		*p = (*p & cmaske) | (*q & 0xF0);
 		++p;
 		++q;
 	}
+#endif
 
 }
 
-uint8_t *Video::getPage(uint8_t page) {
-	uint8_t *p;
+uint8_t Video::getPage(uint8_t page) {
+	uint8_t p;
 	if (page <= 3) {
-		p = _pages[page];
+		p = page;
 	} else {
 		switch (page) {
 		case 0xFF:
-			p = _curPagePtr3;
+			p = _curPage3;
 			break;
 		case 0xFE:
-			p = _curPagePtr2;
+			p = _curPage2;
 			break;
 		default:
-			p = _pages[0]; // XXX check
+			p = 0; // XXX check
 			warning("Video::getPage() p != [0,1,2,3,0xFF,0xFE] == 0x%X", page);
 			break;
 		}
@@ -463,24 +779,68 @@ uint8_t *Video::getPage(uint8_t page) {
 	return p;
 }
 
+// Makes dst an alias of src.
+void Video::sharePage(uint8_t dst, uint8_t src) {
+	if (_pageBuffers[dst] == _pageBuffers[src]) {
+		return;
+	}
+	--_bufferRefs[_pageBuffers[dst]];
+	_pageBuffers[dst] = _pageBuffers[src];
+	++_bufferRefs[_pageBuffers[dst]];
+	_pages[dst] = _pages[src];
+}
+
+// Gives page a buffer of its own, a copy of the shared one unless it is about to be overwritten.
+void Video::unsharePage(uint8_t page, bool keepContent) {
+	const uint8_t shared = _pageBuffers[page];
+	if (_bufferRefs[shared] == 1) {
+		return;
+	}
+	uint8_t b = 0;
+	while (_bufferRefs[b] != 0) {
+		++b;
+	}
+	if (keepContent) {
+		memcpy(_buffers[b], _buffers[shared], VID_PAGE_SIZE);
+	}
+	--_bufferRefs[shared];
+	_bufferRefs[b] = 1;
+	_pageBuffers[page] = b;
+	_pages[page] = _buffers[b];
+}
 
+// Drawing writes to _curPagePtr1, which must not be shared.
+void Video::prepareWorkPage() {
+	unsharePage(_curPage1, true);
+	_curPagePtr1 = _pages[_curPage1];
+}
 
 void Video::changePagePtr1(uint8_t pageID) {
 	debug(DBG_VIDEO, "Video::changePagePtr1(%d)", pageID);
-	_curPagePtr1 = getPage(pageID);
+	flushRaster();
+	_curPage1 = getPage(pageID);
+	_curDamage1 = &_damage[_curPage1];
 }
 
 
 
 void Video::fillPage(uint8_t pageId, uint8_t color) {
 	debug(DBG_VIDEO, "Video::fillPage(%d, %d)", pageId, color);
-	uint8_t *p = getPage(pageId);
-
+	flushRaster();
+	uint8_t page = getPage(pageId);
+	unsharePage(page, false);
+	_damage[page].markAll();
+	uint8_t *p = _pages[page];
+
+#ifdef VIDEO_8BPP
+	memset(p, color & 0xF, VID_PAGE_SIZE);
+#else
 	// Since a palette indice is coded on 4 bits, we need to duplicate the
 	// clearing color to the upper part of the byte.
 	uint8_t c = (color << 4) | color;
 
 	memset(p, c, VID_PAGE_SIZE);
+#endif
 }
 
 /*  This opcode is used once the background of a scene has been drawn in one of the framebuffer:
@@ -488,65 +848,82 @@ void Video::fillPage(uint8_t pageId, uint8_t color) {
 void Video::copyPage(uint8_t srcPageId, uint8_t dstPageId, int16_t vscroll) {
 
 	debug(DBG_VIDEO, "Video::copyPage(%d, %d)", srcPageId, dstPageId);
+	flushRaster();
 
 	if (srcPageId == dstPageId)
 		return;
 
-	uint8_t *p;
-	uint8_t *q;
-
 	if (srcPageId >= 0xFE || !((srcPageId &= 0xBF) & 0x80)) {
-		p = getPage(srcPageId);
-		q = getPage(dstPageId);
-		memcpy(q, p, VID_PAGE_SIZE);
+		uint8_t src = getPage(srcPageId);
+		uint8_t dst = getPage(dstPageId);
+		// No memcpy, dst shares the buffer until either page is written.
+		// The copy differs from the screen exactly where its source does.
+		if (src != dst) {
+			sharePage(dst, src);
+			_damage[dst] = _damage[src];
+		}
 			
 	} else {
-		p = getPage(srcPageId & 3);
-		q = getPage(dstPageId);
+		uint8_t src = getPage(srcPageId & 3);
+		uint8_t dst = getPage(dstPageId);
 		if (vscroll >= -199 && vscroll <= 199) {
-			uint16_t h = 200;
-			if (vscroll < 0) {
-				h += vscroll;
-				p += -vscroll * 160;
+			unsharePage(dst, true);
+			const uint8_t *p = _pages[src];
+			uint8_t *q = _pages[dst];
+			// vscroll is in native lines.
+			const int16_t dy = vscroll * VIDEO_SCALE;
+			int h = VID_HEIGHT;
+			PageDamage *d = &_damage[dst];
+			if (dy < 0) {
+				h += dy;
+				p += -dy * VID_PITCH;
+				d->markRows(0, h - 1);
 			} else {
-				h -= vscroll;
-				q += vscroll * 160;
+				h -= dy;
+				q += dy * VID_PITCH;
+				d->markRows(dy, VID_HEIGHT - 1);
 			}
-			memcpy(q, p, h * 160);
+			memcpy(q, p, h * VID_PITCH);
 		}
 	}
 }
 
 
 
+/*
+	Scaled pages: the row just written, ending at dst, is repeated to fill the
+	VIDEO_SCALE rows of its native line. Returns the start of the next line.
+*/
+static uint8_t *repeatRow(uint8_t *dst) {
+	for (int i = 1; i < VIDEO_SCALE; ++i) {
+		memcpy(dst, dst - VID_PITCH, VID_PITCH);
+		dst += VID_PITCH;
+	}
+	return dst;
+}
 
 void Video::copyPage(const uint8_t *src) {
 	debug(DBG_VIDEO, "Video::copyPage()");
+	flushRaster();
+	unsharePage(0, false);
+	_damage[0].markAll();
+	if (VIDEO_SCALE == 1) {
+		_span->planar(_pages[0], src, VID_PLANE_SIZE, VID_PLANE_SIZE);
+		return;
+	}
+	// Scaled pages: convert a line, then widen its pixels.
+	uint8_t line[VID_NATIVE_WIDTH];
 	uint8_t *dst = _pages[0];
-	int h = 200;
-	while (h--) {
-		int w = 40;
-		while (w--) {
-			uint8_t p[] = {
-				*(src + 8000 * 3),
-				*(src + 8000 * 2),
-				*(src + 8000 * 1),
-				*(src + 8000 * 0)
-			};
-			for(int j = 0; j < 4; ++j) {
-				uint8_t acc = 0;
-				for (int i = 0; i < 8; ++i) {
-					acc <<= 1;
-					acc |= (p[i & 3] & 0x80) ? 1 : 0;
-					p[i & 3] <<= 1;
-				}
-				*dst++ = acc;
+	for (int y = 0; y < VID_NATIVE_HEIGHT; ++y) {
+		_span->planar(line, src, VID_PLANE_SIZE, VID_NATIVE_WIDTH / 8);
+		src += VID_NATIVE_WIDTH / 8;
+		for (int x = 0; x < VID_NATIVE_WIDTH; ++x) {
+			for (int i = 0; i < VIDEO_SCALE; ++i) {
+				*dst++ = line[x];
 			}
-			++src;
 		}
+		dst = repeatRow(dst);
 	}
-
-
 }
 
 /*
@@ -565,57 +942,188 @@ void Video::changePal(uint8_t palNum) {
 }
 
 void Video::updateDisplay(uint8_t pageId) {
+	Frame f;
+	takeFrame(pageId, &f);
+	showFrame(&f);
+	releaseFrame(&f);
+}
 
-	debug(DBG_VIDEO, "Video::updateDisplay(%d)", pageId);
+/*
+	The part of a blit that belongs to the pages: picks the page shown, the
+	palette and the rects to update. Only showFrame() talks to the System, so
+	that it can run on another thread, later.
+*/
+void Video::takeFrame(uint8_t pageId, Frame *f) {
+
+	debug(DBG_VIDEO, "Video::takeFrame(%d)", pageId);
+	flushRaster();
 
 	if (pageId != 0xFE) {
 		if (pageId == 0xFF) {
-			SWAP(_curPagePtr2, _curPagePtr3);
+			SWAP(_curPage2, _curPage3);
 		} else {
-			_curPagePtr2 = getPage(pageId);
+			_curPage2 = getPage(pageId);
 		}
 	}
 
+	PageDamage *d = &_damage[_curPage2];
+
 	//Check if we need to change the palette
+	f->newPalette = false;
 	if (paletteIdRequested != NO_PALETTE_CHANGE_REQUESTED) {
-		changePal(paletteIdRequested);
+		// Copied, a part change may replace segPalettes before the frame is shown.
+		if (paletteIdRequested < 32) {
+			memcpy(f->palette, res->segPalettes + paletteIdRequested * 32, sizeof(f->palette));
+			f->newPalette = true;
+			currentPaletteId = paletteIdRequested;
+		}
 		paletteIdRequested = NO_PALETTE_CHANGE_REQUESTED;
+		d->markAll();
 	}
 
+	f->numRects = buildDisplayRects(d, f->rects);
+
+	// The screen now shows this page: the other pages differ from it
+	// wherever it changed.
+	for (int i = 0; i < 4; ++i) {
+		if (&_damage[i] != d) {
+			_damage[i].add(*d);
+		}
+	}
+	d->clear();
+
+	f->buffer = _pageBuffers[_curPage2];
+	++_bufferRefs[f->buffer];
+}
+
+void Video::showFrame(const Frame *f) {
+	if (f->newPalette) {
+		sys->setPalette(f->palette);
+	}
 	//Q: Why 160 ?
 	//A: Because one byte gives two palette indices so
 	//   we only need to move 320/2 per line.
-  sys->updateDisplay(_curPagePtr2);
+  sys->updateDisplay(_buffers[f->buffer], f->rects, f->numRects);
+}
+
+void Video::releaseFrame(const Frame *f) {
+	--_bufferRefs[f->buffer];
+}
+
+/*
+	Runs of damaged rows become one rect each, as wide as the widest row of the
+	run. Past MAX_DISPLAY_RECTS the last rect grows to cover the remaining rows.
+*/
+int Video::buildDisplayRects(const PageDamage *d, DisplayRect *rects) {
+	int numRects = 0;
+	DisplayRect *r = 0;
+	int16_t x1 = 0, x2 = 0;
+	bool inRun = false;
+	for (int y = 0; y < VID_HEIGHT; ++y) {
+		if (d->x1[y] > d->x2[y]) {
+			inRun = false;
+			continue;
+		}
+		if (!inRun && numRects < MAX_DISPLAY_RECTS) {
+			r = &rects[numRects++];
+			r->y = y;
+			x1 = d->x1[y];
+			x2 = d->x2[y];
+		} else {
+			x1 = MIN(x1, d->x1[y]);
+			x2 = MAX(x2, d->x2[y]);
+		}
+		inRun = true;
+#ifndef VIDEO_8BPP
+		// Whole bytes: even left edge, odd right edge.
+		x1 &= ~1;
+		x2 |= 1;
+#endif
+		r->x = x1;
+		r->w = x2 - x1 + 1;
+		r->h = y - r->y + 1;
+	}
+	return numRects;
 }
 
 void Video::saveOrLoad(Serializer &ser) {
+	flushRaster();
 	uint8_t mask = 0;
 	if (ser._mode == Serializer::SM_SAVE) {
+		mask = (_curPage1 << 4) | (_curPage2 << 2) | _curPage3;
+	} else {
+		// Every page gets its own buffer back, all of them are overwritten.
+		// No Frame is held, DrawList::sync() released it.
+		for (int i = 0; i < NUM_BUFFERS; ++i) {
+			_bufferRefs[i] = 0;
+		}
 		for (int i = 0; i < 4; ++i) {
-			if (_pages[i] == _curPagePtr1)
-				mask |= i << 4;
-			if (_pages[i] == _curPagePtr2)
-				mask |= i << 2;
-			if (_pages[i] == _curPagePtr3)
-				mask |= i << 0;
-		}		
+			_bufferRefs[i] = 1;
+			_pageBuffers[i] = i;
+			_pages[i] = _buffers[i];
+		}
+	}
+#ifdef VIDEO_8BPP
+	// Save states keep the native 4bpp layout so they can be exchanged between
+	// builds. Scaled pages keep the top left pixel of each native one.
+	uint8_t *pages4bpp = (uint8_t *)malloc(4 * VID_PAGE_SIZE_4BPP);
+	uint8_t *savedPages[4];
+	for (int i = 0; i < 4; ++i) {
+		savedPages[i] = pages4bpp + i * VID_PAGE_SIZE_4BPP;
+		if (ser._mode == Serializer::SM_SAVE) {
+			uint8_t *q = savedPages[i];
+			for (int y = 0; y < VID_NATIVE_HEIGHT; ++y) {
+				const uint8_t *p = _pages[i] + y * VIDEO_SCALE * VID_PITCH;
+				for (int x = 0; x < VID_NATIVE_WIDTH; x += 2) {
+					*q++ = (p[x * VIDEO_SCALE] << 4) | p[(x + 1) * VIDEO_SCALE];
+				}
+			}
+		}
 	}
+#else
+	uint8_t **savedPages = _pages;
+#endif
 	Serializer::Entry entries[] = {
 		SE_INT(&currentPaletteId, Serializer::SES_INT8, VER(1)),
 		SE_INT(&paletteIdRequested, Serializer::SES_INT8, VER(1)),
 		SE_INT(&mask, Serializer::SES_INT8, VER(1)),
-		SE_ARRAY(_pages[0], Video::VID_PAGE_SIZE, Serializer::SES_INT8, VER(1)),
-		SE_ARRAY(_pages[1], Video::VID_PAGE_SIZE, Serializer::SES_INT8, VER(1)),
-		SE_ARRAY(_pages[2], Video::VID_PAGE_SIZE, Serializer::SES_INT8, VER(1)),
-		SE_ARRAY(_pages[3], Video::VID_PAGE_SIZE, Serializer::SES_INT8, VER(1)),
+		SE_ARRAY(savedPages[0], Video::VID_PAGE_SIZE_4BPP, Serializer::SES_INT8, VER(1)),
+		SE_ARRAY(savedPages[1], Video::VID_PAGE_SIZE_4BPP, Serializer::SES_INT8, VER(1)),
+		SE_ARRAY(savedPages[2], Video::VID_PAGE_SIZE_4BPP, Serializer::SES_INT8, VER(1)),
+		SE_ARRAY(savedPages[3], Video::VID_PAGE_SIZE_4BPP, Serializer::SES_INT8, VER(1)),
 		SE_END()
 	};
 	ser.saveOrLoadEntries(entries);
+#ifdef VIDEO_8BPP
+	if (ser._mode == Serializer::SM_LOAD) {
+		for (int i = 0; i < 4; ++i) {
+			const uint8_t *q = savedPages[i];
+			uint8_t *dst = _pages[i];
+			for (int j = 0; j < VID_PAGE_SIZE_4BPP; ++j) {
+				for (int k = 0; k < VIDEO_SCALE; ++k) {
+					*dst++ = *q >> 4;
+				}
+				for (int k = 0; k < VIDEO_SCALE; ++k) {
+					*dst++ = *q & 0xF;
+				}
+				++q;
+				if (j % (VID_NATIVE_WIDTH / 2) == VID_NATIVE_WIDTH / 2 - 1) {
+					dst = repeatRow(dst);
+				}
+			}
+		}
+	}
+	::free(pages4bpp);
+#endif
 
 	if (ser._mode == Serializer::SM_LOAD) {
-		_curPagePtr1 = _pages[(mask >> 4) & 0x3];
-		_curPagePtr2 = _pages[(mask >> 2) & 0x3];
-		_curPagePtr3 = _pages[(mask >> 0) & 0x3];
+		_curPage1 = (mask >> 4) & 0x3;
+		_curPage2 = (mask >> 2) & 0x3;
+		_curPage3 = (mask >> 0) & 0x3;
+		_curDamage1 = &_damage[_curPage1];
+		for (int i = 0; i < 4; ++i) {
+			_damage[i].markAll();
+		}
 		changePal(currentPaletteId);
 	}
 }
@@ -20,6 +20,7 @@
 #define __VIDEO_H__
 
 #include "intern.h"
+#include "sys.h"
 
 struct StrEntry {
 	uint16_t id;
@@ -33,14 +34,90 @@ struct Polygon {
 
 	uint16_t bbw, bbh;
 	uint8_t numPoints;
-	Point points[MAX_POINTS];
+	Point *points;
 
+	// Vertices are in page pixels, VIDEO_SCALE times the bytecode units.
 	void readVertices(const uint8_t *p, uint16_t zoom);
+
+	// A single screen pixel, drawn as a VIDEO_SCALE wide square.
+	bool isPoint() const {
+		return bbw == 0 && bbh == 1 && numPoints == 4;
+	}
+};
+
+/*
+	Shapes of segCinematic/_segVideo2 decoded once per (buffer, offset, zoom):
+	a hierarchy is flattened into its polygons, each with the vertices already
+	scaled and its center relative to the shape origin. Drawing a cached shape
+	only translates and rasterizes. The cache is flushed when the part or its
+	resources change, and when it fills up.
+*/
+struct PolygonCache {
+	enum {
+		MAX_SHAPES = 1024, // hash slots, a power of two
+		MAX_POLYGONS = 4096,
+		MAX_VERTICES = 32768
+	};
+
+	struct Shape {
+		const uint8_t *buf;
+		uint16_t offset, zoom;
+		uint16_t firstPolygon, numPolygons;
+	};
+
+	struct Item {
+		Point pos;
+		uint8_t color;
+		bool callerColor; // root polygon: the caller's color wins unless it has bit 7 set
+		Polygon poly;
+	};
+
+	Shape _shapes[MAX_SHAPES];
+	uint16_t _numShapes;
+	Item _items[MAX_POLYGONS];
+	uint16_t _numItems;
+	Point _vertices[MAX_VERTICES];
+	uint16_t _numVertices;
+
+	void clear();
+	Shape *lookup(const uint8_t *buf, uint16_t offset, uint16_t zoom);
+	Item *addPolygon(uint8_t numPoints);
+};
+
+/*
+	Columns of each row of a page that may differ from the frame on screen.
+	Drawing grows the ranges; presenting a page hands its ranges to the other
+	pages (they now differ from the screen wherever it changed) and clears it.
+*/
+struct PageDamage {
+	int16_t x1[VID_HEIGHT], x2[VID_HEIGHT]; // an empty row has x1 > x2
+
+	void clear();
+	void markAll();
+	void markRows(int16_t y1, int16_t y2);
+	void add(const PageDamage &d);
+
+	void mark(int16_t y, int16_t xmin, int16_t xmax) {
+		if (xmin < x1[y]) x1[y] = xmin;
+		if (xmax > x2[y]) x2[y] = xmax;
+	}
+};
+
+/*
+	A polygon queued by the band rasterizer, with the rows it touches.
+*/
+struct RasterCommand {
+	Polygon poly;
+	Point pt;
+	uint8_t color;
+	int16_t y1, y2;
 };
 
 struct Resource;
 struct Serializer;
+struct SpanKernels;
 struct System;
+struct ThreadPool;
 
 // This is used to detect the end of  _stringsTableEng and _stringsTableDemo
 #define END_OF_STRING_DICTIONARY 0xFFFF 
@@ -51,10 +128,29 @@ struct System;
 
 
 struct Video {
-	typedef void (Video::*drawLine)(int16_t x1, int16_t x2, uint8_t col);
+	typedef void (Video::*drawLine)(int16_t x1, int16_t x2, int16_t y, uint8_t col);
 
 	enum {
-		VID_PAGE_SIZE  = 320 * 200 / 2
+		VID_PAGE_SIZE  = VID_PITCH * VID_HEIGHT,
+		VID_PAGE_SIZE_4BPP = VID_NATIVE_WIDTH * VID_NATIVE_HEIGHT / 2, // the format of the save states
+		VID_PLANE_SIZE = VID_NATIVE_WIDTH * VID_NATIVE_HEIGHT / 8, // one of the 4 bitplanes of a POLY_ANIM bitmap
+		MAX_DISPLAY_RECTS = 16,
+		MAX_RASTER_THREADS = 16,
+		MAX_RASTER_COMMANDS = 4096,
+		NUM_BUFFERS = 5
+	};
+
+	/*
+		A presented page, taken by takeFrame() and shown by showFrame(). It
+		keeps a reference to the buffer of the page until releaseFrame(), the
+		page gets a copy if it is drawn on meanwhile.
+	*/
+	struct Frame {
+		uint8_t buffer;
+		bool newPalette;
+		uint8_t palette[NUM_COLORS * 2];
+		DisplayRect rects[MAX_DISPLAY_RECTS];
+		int numRects;
 	};
 
 	static const uint8_t _font[];
@@ -67,45 +163,84 @@ struct Video {
 
 
 	uint8_t paletteIdRequested, currentPaletteId;
-	uint8_t *_pages[4];
+
+	// The 4 pages are reference counted buffers: a copyPage() without scroll
+	// makes the destination share the buffer of its source, and a page only
+	// gets its own copy back when it is written to. The fifth buffer is for
+	// the Frame a render thread holds (see DrawList): with at most five
+	// references, a shared buffer always leaves another free.
+	uint8_t *_buffers[NUM_BUFFERS];
+	uint8_t _bufferRefs[NUM_BUFFERS];
+	uint8_t _pageBuffers[4]; // buffer of each page
+	uint8_t *_pages[4]; // _buffers[_pageBuffers[i]], for reading
 
 	// I am almost sure that:
-	// _curPagePtr1 is the work buffer
-	// _curPagePtr2 is the background buffer1
-	// _curPagePtr3 is the background buffer2
-	uint8_t *_curPagePtr1, *_curPagePtr2, *_curPagePtr3;
+	// _curPage1 is the work buffer
+	// _curPage2 is the background buffer1
+	// _curPage3 is the background buffer2
+	uint8_t _curPage1, _curPage2, _curPage3;
+	uint8_t *_curPagePtr1; // where drawing goes, set by prepareWorkPage()
+
+	PageDamage _damage[4];
+	PageDamage *_curDamage1; // damage of _curPage1
+
+	PolygonCache *_polyCache;
+
+	// Band rasterizer, only set up by setRasterThreads(). Polygons drawn on
+	// _curPagePtr1 are queued and filled by one thread per horizontal band
+	// before anything else touches the pages.
+	ThreadPool *_rasterPool;
+	int _numRasterBands;
+	RasterCommand *_rasterQueue;
+	int _rasterQueueLen;
+	uint16_t *_rasterBins[MAX_RASTER_THREADS];
+	int _rasterBinLen[MAX_RASTER_THREADS];
 
-	Polygon polygon;
-	int16_t _hliney;
+	//Precomputer division lookup table, 16.16 reciprocals of the edge heights
+	uint32_t _interpTable[0x400 * VIDEO_SCALE];
 
-	//Precomputer division lookup table
-	uint16_t _interpTable[0x400];
+	// Span writers picked for this CPU (see simd.h).
+	const SpanKernels *_span;
 
 	Ptr _pData;
 	uint8_t *_dataBuf;
 
 	Video(Resource *res, System *stub);
 	void init();
+	void free();
 
 	void setDataBuffer(uint8_t *dataBuf, uint16_t offset);
 	void readAndDrawPolygon(uint8_t color, uint16_t zoom, const Point &pt);
-	void fillPolygon(uint16_t color, uint16_t zoom, const Point &pt);
-	void readAndDrawPolygonHierarchy(uint16_t zoom, const Point &pt);
+	bool readPolygon(uint8_t color, uint16_t zoom, const Point &pos, bool root);
+	bool readPolygonHierarchy(uint16_t zoom, const Point &pos);
+	void invalidatePolygonCache();
+	void fillPolygon(uint16_t color, const Polygon &poly, const Point &pt);
+	void rasterPolygon(uint16_t color, const Polygon &poly, const Point &pt, int16_t yMin, int16_t yMax);
+	void setRasterThreads(int numThreads);
+	void flushRaster();
+	void rasterBand(int band);
 	int32_t calcStep(const Point &p1, const Point &p2, uint16_t &dy);
 
 	void drawString(uint8_t color, uint16_t x, uint16_t y, uint16_t strId);
-	void drawChar(uint8_t c, uint16_t x, uint16_t y, uint8_t color, uint8_t *buf);
+	void drawChar(uint8_t c, uint16_t x, uint16_t y, uint8_t color);
 	void drawPoint(uint8_t color, int16_t x, int16_t y);
-	void drawLineBlend(int16_t x1, int16_t x2, uint8_t color);
-	void drawLineN(int16_t x1, int16_t x2, uint8_t color);
-	void drawLineP(int16_t x1, int16_t x2, uint8_t color);
-	uint8_t *getPage(uint8_t page);
+	void drawLineBlend(int16_t x1, int16_t x2, int16_t y, uint8_t color);
+	void drawLineN(int16_t x1, int16_t x2, int16_t y, uint8_t color);
+	void drawLineP(int16_t x1, int16_t x2, int16_t y, uint8_t color);
+	uint8_t getPage(uint8_t page);
+	void sharePage(uint8_t dst, uint8_t src);
+	void unsharePage(uint8_t page, bool keepContent);
+	void prepareWorkPage();
+	int buildDisplayRects(const PageDamage *d, DisplayRect *rects);
 	void changePagePtr1(uint8_t page);
 	void fillPage(uint8_t page, uint8_t color);
 	void copyPage(uint8_t src, uint8_t dst, int16_t vscroll);
 	void copyPage(const uint8_t *src);
 	void changePal(uint8_t pal);
 	void updateDisplay(uint8_t page);
+	void takeFrame(uint8_t page, Frame *f);
+	void showFrame(const Frame *f);
+	void releaseFrame(const Frame *f);
 	
 	void saveOrLoad(Serializer &ser);
 };
@@ -18,17 +18,18 @@
 
 #include <ctime>
 #include "vm.h"
+#include "profiler.h"
 #include "mixer.h"
 #include "resource.h"
-#include "video.h"
+#include "drawlist.h"
 #include "serializer.h"
 #include "sfxplayer.h"
 #include "sys.h"
 #include "parts.h"
 #include "file.h"
 
-VirtualMachine::VirtualMachine(Mixer *mix, Resource *resParameter, SfxPlayer *ply, Video *vid, System *stub)
-	: mixer(mix), res(resParameter), player(ply), video(vid), sys(stub) {
+VirtualMachine::VirtualMachine(Mixer *mix, Resource *resParameter, SfxPlayer *ply, DrawList *draw, System *stub)
+	: mixer(mix), res(resParameter), player(ply), drawList(draw), sys(stub), _profiler(0), _lastTimeStamp(0) {
 }
 
 void VirtualMachine::init() {
@@ -49,28 +50,28 @@ void VirtualMachine::init() {
 }
 
 void VirtualMachine::op_movConst() {
-	uint8_t variableId = _scriptPtr.fetchByte();
-	int16_t value = _scriptPtr.fetchWord();
+	uint8_t variableId = _insn->args[0];
+	int16_t value = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_movConst(0x%02X, %d)", variableId, value);
 	vmVariables[variableId] = value;
 }
 
 void VirtualMachine::op_mov() {
-	uint8_t dstVariableId = _scriptPtr.fetchByte();
-	uint8_t srcVariableId = _scriptPtr.fetchByte();	
+	uint8_t dstVariableId = _insn->args[0];
+	uint8_t srcVariableId = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_mov(0x%02X, 0x%02X)", dstVariableId, srcVariableId);
 	vmVariables[dstVariableId] = vmVariables[srcVariableId];
 }
 
 void VirtualMachine::op_add() {
-	uint8_t dstVariableId = _scriptPtr.fetchByte();
-	uint8_t srcVariableId = _scriptPtr.fetchByte();
+	uint8_t dstVariableId = _insn->args[0];
+	uint8_t srcVariableId = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_add(0x%02X, 0x%02X)", dstVariableId, srcVariableId);
 	vmVariables[dstVariableId] += vmVariables[srcVariableId];
 }
 
 void VirtualMachine::op_addConst() {
-	if (res->currentPartId == 0x3E86 && _scriptPtr.pc == res->segBytecode + 0x6D48) {
+	if (res->currentPartId == 0x3E86 && _insn->pc == 0x6D47) {
 		warning("VirtualMachine::op_addConst() hack for non-stop looping gun sound bug");
 		// the script 0x27 slot 0x17 doesn't stop the gun sound from looping, I 
 		// don't really know why ; for now, let's play the 'stopping sound' like 
@@ -80,24 +81,23 @@ void VirtualMachine::op_addConst() {
 		//  (0x6D47) VAR(6) += -50
 		snd_playSound(0x5B, 1, 64, 1);
 	}
-	uint8_t variableId = _scriptPtr.fetchByte();
-	int16_t value = _scriptPtr.fetchWord();
+	uint8_t variableId = _insn->args[0];
+	int16_t value = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_addConst(0x%02X, %d)", variableId, value);
 	vmVariables[variableId] += value;
 }
 
 void VirtualMachine::op_call() {
 
-	uint16_t offset = _scriptPtr.fetchWord();
 	uint8_t sp = _stackPtr;
 
-	debug(DBG_VM, "VirtualMachine::op_call(0x%X)", offset);
-	_scriptStackCalls[sp] = _scriptPtr.pc - res->segBytecode;
+	debug(DBG_VM, "VirtualMachine::op_call(0x%X)", _instructions[_insn->target].pc);
+	_scriptStackCalls[sp] = _instructions[_insn->next].pc;
 	if (_stackPtr == 0xFF) {
 		error("VirtualMachine::op_call() ec=0x%X stack overflow", 0x8F);
 	}
 	++_stackPtr;
-	_scriptPtr.pc = res->segBytecode + offset ;
+	_nextInsn = _insn->target;
 }
 
 void VirtualMachine::op_ret() {
@@ -107,7 +107,7 @@ void VirtualMachine::op_ret() {
 	}	
 	--_stackPtr;
 	uint8_t sp = _stackPtr;
-	_scriptPtr.pc = res->segBytecode + _scriptStackCalls[sp];
+	_nextInsn = translate(_scriptStackCalls[sp]);
 }
 
 void VirtualMachine::op_pauseThread() {
@@ -116,41 +116,39 @@ void VirtualMachine::op_pauseThread() {
 }
 
 void VirtualMachine::op_jmp() {
-	uint16_t pcOffset = _scriptPtr.fetchWord();
-	debug(DBG_VM, "VirtualMachine::op_jmp(0x%02X)", pcOffset);
-	_scriptPtr.pc = res->segBytecode + pcOffset;	
+	debug(DBG_VM, "VirtualMachine::op_jmp(0x%02X)", _instructions[_insn->target].pc);
+	_nextInsn = _insn->target;
 }
 
 void VirtualMachine::op_setSetVect() {
-	uint8_t threadId = _scriptPtr.fetchByte();
-	uint16_t pcOffsetRequested = _scriptPtr.fetchWord();
+	uint8_t threadId = _insn->args[0];
+	uint16_t pcOffsetRequested = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_setSetVect(0x%X, 0x%X)", threadId,pcOffsetRequested);
 	threadsData[REQUESTED_PC_OFFSET][threadId] = pcOffsetRequested;
+	if (threadId < VM_NUM_THREADS) {
+		_setVecThreadsMask |= (uint64_t)1 << threadId;
+	}
 }
 
 void VirtualMachine::op_jnz() {
-	uint8_t i = _scriptPtr.fetchByte();
+	uint8_t i = _insn->args[0];
 	debug(DBG_VM, "VirtualMachine::op_jnz(0x%02X)", i);
 	--vmVariables[i];
 	if (vmVariables[i] != 0) {
 		op_jmp();
-	} else {
-		_scriptPtr.fetchWord();
 	}
 }
 
 void VirtualMachine::op_condJmp() {
-	uint8_t opcode = _scriptPtr.fetchByte();
-  const uint8_t var = _scriptPtr.fetchByte();
+	uint8_t opcode = _insn->flags;
+  const uint8_t var = _insn->args[0];
   int16_t b = vmVariables[var];
 	int16_t a;
 
 	if (opcode & 0x80) {
-		a = vmVariables[_scriptPtr.fetchByte()];
-	} else if (opcode & 0x40) {
-    a = _scriptPtr.fetchWord();
+		a = vmVariables[(uint8_t)_insn->args[1]];
 	} else {
-    a = _scriptPtr.fetchByte();
+		a = _insn->args[1];
 	}
 	debug(DBG_VM, "VirtualMachine::op_condJmp(%d, 0x%02X, 0x%02X)", opcode, b, a);
 
@@ -202,22 +200,20 @@ void VirtualMachine::op_condJmp() {
 
 	if (expr) {
 		op_jmp();
-	} else {
-		_scriptPtr.fetchWord();
 	}
 
 }
 
 void VirtualMachine::op_setPalette() {
-	uint16_t paletteId = _scriptPtr.fetchWord();
+	uint16_t paletteId = _insn->args[0];
 	debug(DBG_VM, "VirtualMachine::op_changePalette(%d)", paletteId);
-	video->paletteIdRequested = paletteId >> 8;
+	drawList->setPalette(paletteId >> 8);
 }
 
 void VirtualMachine::op_resetThread() {
 
-	uint8_t threadId = _scriptPtr.fetchByte();
-	uint8_t i =        _scriptPtr.fetchByte();
+	uint8_t threadId = _insn->args[0];
+	uint8_t i =        _insn->args[1];
 
 	// FCS: WTF, this is cryptic as hell !!
 	//int8_t n = (i & 0x3F) - threadId;  //0x3F = 0011 1111
@@ -232,52 +228,67 @@ void VirtualMachine::op_resetThread() {
 		return;
 	}
 	++n;
-	uint8_t a = _scriptPtr.fetchByte();
+	uint8_t a = _insn->args[2];
 
 	debug(DBG_VM, "VirtualMachine::op_resetThread(%d, %d, %d)", threadId, i, a);
 
+	// Threads threadId..i, as a mask.
+	uint64_t range = 0;
+	if (threadId < VM_NUM_THREADS) {
+		range = (n >= VM_NUM_THREADS ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << threadId;
+	}
+
 	if (a == 2) {
 		uint16_t *p = &threadsData[REQUESTED_PC_OFFSET][threadId];
 		while (n--) {
 			*p++ = 0xFFFE;
 		}
+		_setVecThreadsMask |= range;
 	} else if (a < 2) {
 		uint8_t *p = &vmIsChannelActive[REQUESTED_STATE][threadId];
 		while (n--) {
 			*p++ = a;
 		}
+		if (a) {
+			_requestedPausedThreadsMask |= range;
+		} else {
+			_requestedPausedThreadsMask &= ~range;
+		}
 	}
 }
 
 void VirtualMachine::op_selectVideoPage() {
-	uint8_t frameBufferId = _scriptPtr.fetchByte();
+	uint8_t frameBufferId = _insn->args[0];
 	debug(DBG_VM, "VirtualMachine::op_selectVideoPage(%d)", frameBufferId);
-	video->changePagePtr1(frameBufferId);
+	drawList->selectPage(frameBufferId);
 }
 
 void VirtualMachine::op_fillVideoPage() {
-	uint8_t pageId = _scriptPtr.fetchByte();
-	uint8_t color = _scriptPtr.fetchByte();
+	uint8_t pageId = _insn->args[0];
+	uint8_t color = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_fillVideoPage(%d, %d)", pageId, color);
-	video->fillPage(pageId, color);
+	drawList->fillPage(pageId, color);
 }
 
 void VirtualMachine::op_copyVideoPage() {
-	uint8_t srcPageId = _scriptPtr.fetchByte();
-	uint8_t dstPageId = _scriptPtr.fetchByte();
+	uint8_t srcPageId = _insn->args[0];
+	uint8_t dstPageId = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_copyVideoPage(%d, %d)", srcPageId, dstPageId);
-	video->copyPage(srcPageId, dstPageId, vmVariables[VM_VARIABLE_SCROLL_Y]);
+	drawList->copyPage(srcPageId, dstPageId, vmVariables[VM_VARIABLE_SCROLL_Y]);
 }
 
 
-uint32_t lastTimeStamp = 0;
 void VirtualMachine::op_blitFramebuffer() {
 
-	uint8_t pageId = _scriptPtr.fetchByte();
+	uint8_t pageId = _insn->args[0];
 	debug(DBG_VM, "VirtualMachine::op_blitFramebuffer(%d)", pageId);
 	inp_handleSpecialKeys();
 
-  int32_t delay = sys->getTimeStamp() - lastTimeStamp;
+	// The previous frame, if the render thread held it, is shown before the
+	// pause: frames and audio reach the System in the usual order.
+	drawList->present();
+
+  int32_t delay = sys->getTimeStamp() - _lastTimeStamp;
   int32_t timeToSleep = vmVariables[VM_VARIABLE_PAUSE_SLICES] * 20 - delay;
 
   // The bytecode will set vmVariables[VM_VARIABLE_PAUSE_SLICES] from 1 to 5
@@ -287,80 +298,83 @@ void VirtualMachine::op_blitFramebuffer() {
     sys->sleep(timeToSleep);
   }
 
-  lastTimeStamp = sys->getTimeStamp();
+  _lastTimeStamp = sys->getTimeStamp();
 
 	//WTF ?
 	vmVariables[0xF7] = 0;
 
-	video->updateDisplay(pageId);
+	drawList->blit(pageId);
 }
 
 void VirtualMachine::op_killThread() {
 	debug(DBG_VM, "VirtualMachine::op_killThread()");
-	_scriptPtr.pc = res->segBytecode + 0xFFFF;
+	_nextInsn = translate(VM_INACTIVE_THREAD);
 	gotoNextThread = true;
 }
 
 void VirtualMachine::op_drawString() {
-	uint16_t stringId = _scriptPtr.fetchWord();
-	uint16_t x = _scriptPtr.fetchByte();
-	uint16_t y = _scriptPtr.fetchByte();
-	uint16_t color = _scriptPtr.fetchByte();
+	uint16_t stringId = _insn->args[0];
+	uint16_t x = _insn->args[1];
+	uint16_t y = _insn->args[2];
+	uint16_t color = _insn->args[3];
 
 	debug(DBG_VM, "VirtualMachine::op_drawString(0x%03X, %d, %d, %d)", stringId, x, y, color);
 
-	video->drawString(color, x, y, stringId);
+	drawList->drawString(color, x, y, stringId);
 }
 
 void VirtualMachine::op_sub() {
-	uint8_t i = _scriptPtr.fetchByte();
-	uint8_t j = _scriptPtr.fetchByte();
+	uint8_t i = _insn->args[0];
+	uint8_t j = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_sub(0x%02X, 0x%02X)", i, j);
 	vmVariables[i] -= vmVariables[j];
 }
 
 void VirtualMachine::op_and() {
-	uint8_t variableId = _scriptPtr.fetchByte();
-	uint16_t n = _scriptPtr.fetchWord();
+	uint8_t variableId = _insn->args[0];
+	uint16_t n = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_and(0x%02X, %d)", variableId, n);
 	vmVariables[variableId] = (uint16_t)vmVariables[variableId] & n;
 }
 
 void VirtualMachine::op_or() {
-	uint8_t variableId = _scriptPtr.fetchByte();
-	uint16_t value = _scriptPtr.fetchWord();
+	uint8_t variableId = _insn->args[0];
+	uint16_t value = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_or(0x%02X, %d)", variableId, value);
 	vmVariables[variableId] = (uint16_t)vmVariables[variableId] | value;
 }
 
 void VirtualMachine::op_shl() {
-	uint8_t variableId = _scriptPtr.fetchByte();
-	uint16_t leftShiftValue = _scriptPtr.fetchWord();
+	uint8_t variableId = _insn->args[0];
+	uint16_t leftShiftValue = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_shl(0x%02X, %d)", variableId, leftShiftValue);
 	vmVariables[variableId] = (uint16_t)vmVariables[variableId] << leftShiftValue;
 }
 
 void VirtualMachine::op_shr() {
-	uint8_t variableId = _scriptPtr.fetchByte();
-	uint16_t rightShiftValue = _scriptPtr.fetchWord();
+	uint8_t variableId = _insn->args[0];
+	uint16_t rightShiftValue = _insn->args[1];
 	debug(DBG_VM, "VirtualMachine::op_shr(0x%02X, %d)", variableId, rightShiftValue);
 	vmVariables[variableId] = (uint16_t)vmVariables[variableId] >> rightShiftValue;
 }
 
 void VirtualMachine::op_playSound() {
-	uint16_t resourceId = _scriptPtr.fetchWord();
-	uint8_t freq = _scriptPtr.fetchByte();
-	uint8_t vol = _scriptPtr.fetchByte();
-	uint8_t channel = _scriptPtr.fetchByte();
+	uint16_t resourceId = _insn->args[0];
+	uint8_t freq = _insn->args[1];
+	uint8_t vol = _insn->args[2];
+	uint8_t channel = _insn->args[3];
 	debug(DBG_VM, "VirtualMachine::op_playSound(0x%X, %d, %d, %d)", resourceId, freq, vol, channel);
 	snd_playSound(resourceId, freq, vol, channel);
 }
 
 void VirtualMachine::op_updateMemList() {
 
-	uint16_t resourceId = _scriptPtr.fetchWord();
+	uint16_t resourceId = _insn->args[0];
 	debug(DBG_VM, "VirtualMachine::op_updateMemList(%d)", resourceId);
 
+	// Loads overwrite memory the queued polygons may still read.
+	drawList->sync();
+
 	if (resourceId == 0) {
 		player->stop();
 		mixer->stopAll();
@@ -371,9 +385,9 @@ void VirtualMachine::op_updateMemList() {
 }
 
 void VirtualMachine::op_playMusic() {
-	uint16_t resNum = _scriptPtr.fetchWord();
-	uint16_t delay = _scriptPtr.fetchWord();
-	uint8_t pos = _scriptPtr.fetchByte();
+	uint16_t resNum = _insn->args[0];
+	uint16_t delay = _insn->args[1];
+	uint8_t pos = _insn->args[2];
 	debug(DBG_VM, "VirtualMachine::op_playMusic(0x%X, %d, %d)", resNum, delay, pos);
 	snd_playMusic(resNum, delay, pos);
 }
@@ -386,7 +400,10 @@ void VirtualMachine::initForPart(uint16_t partId) {
 	//WTF is that ?
 	vmVariables[0xE4] = 0x14;
 
+	drawList->sync();
 	res->setupPart(partId);
+	resetInstructionCache();
+	res->prefetchPart(predictNextPart());
 
 	//Set all thread to inactive (pc at 0xFFFF or 0xFFFE )
 	memset((uint8_t *)threadsData, 0xFF, sizeof(threadsData));
@@ -396,6 +413,42 @@ void VirtualMachine::initForPart(uint16_t partId) {
 	
 	int firstThreadId = 0;
 	threadsData[PC_OFFSET][firstThreadId] = 0;	
+
+	rebuildThreadMasks();
+}
+
+/*
+	The part the game most likely switches to from the current one: the first
+	one the bytecode asks for with updateMemList, otherwise the part after it.
+	Only the instructions already decoded are looked at.
+*/
+uint16_t VirtualMachine::predictNextPart() {
+	for (uint32_t i = 1; i < _numInstructions; ++i) {
+		const VMInstruction *insn = &_instructions[i];
+		const uint16_t resourceId = insn->args[0];
+		if (insn->opcode == 0x19 && resourceId >= GAME_PART_FIRST && resourceId <= GAME_PART_LAST && resourceId != res->currentPartId) {
+			return resourceId;
+		}
+	}
+	return res->currentPartId + 1;
+}
+
+void VirtualMachine::rebuildThreadMasks() {
+	_activeThreadsMask = 0;
+	_pausedThreadsMask = 0;
+	_requestedPausedThreadsMask = 0;
+	_setVecThreadsMask = 0;
+	for (int threadId = 0; threadId < VM_NUM_THREADS; threadId++) {
+		uint64_t bit = (uint64_t)1 << threadId;
+		if (threadsData[PC_OFFSET][threadId] != VM_INACTIVE_THREAD)
+			_activeThreadsMask |= bit;
+		if (threadsData[REQUESTED_PC_OFFSET][threadId] != VM_NO_SETVEC_REQUESTED)
+			_setVecThreadsMask |= bit;
+		if (vmIsChannelActive[CURR_STATE][threadId])
+			_pausedThreadsMask |= bit;
+		if (vmIsChannelActive[REQUESTED_STATE][threadId])
+			_requestedPausedThreadsMask |= bit;
+	}
 }
 
 /* 
@@ -421,9 +474,19 @@ void VirtualMachine::checkThreadRequests() {
 	// PAUSE:
 	// Note: If a pause has been requested it is stored in  vmIsChannelActive[REQUESTED_STATE][i]
 
-	for (int threadId = 0; threadId < VM_NUM_THREADS; threadId++) {
-
+	// Only the threads whose pause state differs need to be copied.
+	uint64_t changed = _pausedThreadsMask ^ _requestedPausedThreadsMask;
+	while (changed) {
+		int threadId = lowestBit64(changed);
+		changed &= changed - 1;
 		vmIsChannelActive[CURR_STATE][threadId] = vmIsChannelActive[REQUESTED_STATE][threadId];
+	}
+	_pausedThreadsMask = _requestedPausedThreadsMask;
+
+	uint64_t pending = _setVecThreadsMask;
+	while (pending) {
+		int threadId = lowestBit64(pending);
+		pending &= pending - 1;
 
 		uint16_t n = threadsData[REQUESTED_PC_OFFSET][threadId];
 
@@ -431,8 +494,16 @@ void VirtualMachine::checkThreadRequests() {
 
 			threadsData[PC_OFFSET][threadId] = (n == 0xFFFE) ? VM_INACTIVE_THREAD : n;
 			threadsData[REQUESTED_PC_OFFSET][threadId] = VM_NO_SETVEC_REQUESTED;
+
+			uint64_t bit = (uint64_t)1 << threadId;
+			if (n == 0xFFFE) {
+				_activeThreadsMask &= ~bit;
+			} else {
+				_activeThreadsMask |= bit;
+			}
 		}
 	}
+	_setVecThreadsMask = 0;
 }
 
 void VirtualMachine::hostFrame() {
@@ -441,35 +512,45 @@ void VirtualMachine::hostFrame() {
 	// Inactive threads are marked with a thread instruction pointer set to 0xFFFF (VM_INACTIVE_THREAD).
 	// A thread must feature a break opcode so the interpreter can move to the next thread.
 
-	for (int threadId = 0; threadId < VM_NUM_THREADS; threadId++) {
+	// Threads only change each other's requested state, never the current one, so
+	// the set of threads to run is known before the first one starts. Walking the
+	// bits from the lowest up keeps the original 0..63 execution order.
+	uint64_t runnable = _activeThreadsMask & ~_pausedThreadsMask;
 
-		if (vmIsChannelActive[CURR_STATE][threadId])
-			continue;
-		
-		uint16_t n = threadsData[PC_OFFSET][threadId];
+	if (_profiler) {
+		_profiler->beginFrame(res->currentPartId);
+	}
 
-		if (n != VM_INACTIVE_THREAD) {
+	while (runnable) {
 
-			// Set the script pointer to the right location.
-			// script pc is used in executeThread in order
-			// to get the next opcode.
-			_scriptPtr.pc = res->segBytecode + n;
-			_stackPtr = 0;
+		int threadId = lowestBit64(runnable);
+		runnable &= runnable - 1;
 
-			gotoNextThread = false;
-			debug(DBG_VM, "VirtualMachine::hostFrame() i=0x%02X n=0x%02X *p=0x%02X", threadId, n, *_scriptPtr.pc);
-			executeThread();
+		uint16_t n = threadsData[PC_OFFSET][threadId];
 
-			//Since .pc is going to be modified by this next loop iteration, we need to save it.
-			threadsData[PC_OFFSET][threadId] = _scriptPtr.pc - res->segBytecode;
+		// Point the interpreter at the decoded instruction for this pc.
+		// executeThread walks the decoded array from there.
+		_nextInsn = translate(n);
+		_stackPtr = 0;
 
+		gotoNextThread = false;
+		debug(DBG_VM, "VirtualMachine::hostFrame() i=0x%02X n=0x%02X *p=0x%02X", threadId, n, *(res->segBytecode + n));
+		if (_profiler) {
+			executeThreadProfiled(threadId);
+		} else {
+			executeThread();
+		}
 
-			debug(DBG_VM, "VirtualMachine::hostFrame() i=0x%02X pos=0x%X", threadId, threadsData[PC_OFFSET][threadId]);
-			if (sys->input.quit) {
-				break;
-			}
+		//Since the next thread is going to reuse the interpreter, we need to save where this one stopped.
+		threadsData[PC_OFFSET][threadId] = _instructions[_nextInsn].pc;
+		if (threadsData[PC_OFFSET][threadId] == VM_INACTIVE_THREAD) {
+			_activeThreadsMask &= ~((uint64_t)1 << threadId);
+		}
+
+		debug(DBG_VM, "VirtualMachine::hostFrame() i=0x%02X pos=0x%X", threadId, threadsData[PC_OFFSET][threadId]);
+		if (sys->input.quit) {
+			break;
 		}
-		
 	}
 }
 
@@ -477,111 +558,160 @@ void VirtualMachine::hostFrame() {
 #define DEFAULT_ZOOM 0x40
 
 
+void VirtualMachine::op_drawCinematicPolygon() {
+	uint16_t off = _insn->args[0];
+	res->_useSegVideo2 = false;
+	int16_t x = _insn->args[1];
+	int16_t y = _insn->args[2];
+	debug(DBG_VIDEO, "vid_opcd_0x80 : opcode=0x%X off=0x%X x=%d y=%d", *(res->segBytecode + _insn->pc), off, x, y);
+
+	// This switch the polygon database to "cinematic" and probably draws a black polygon
+	// over all the screen.
+	drawList->drawPolygon(res->segCinematic, false, off, COLOR_BLACK, DEFAULT_ZOOM, x, y);
+}
+
+void VirtualMachine::op_drawPolygon() {
+	uint16_t off = _insn->args[0];
+	int16_t x = _insn->args[1];
+	int16_t y = _insn->args[2];
+	uint16_t zoom = _insn->args[3];
+
+	if (_insn->flags & VM_INSN_X_VAR) {
+		x = vmVariables[x];
+	}
+	if (_insn->flags & VM_INSN_Y_VAR) {
+		y = vmVariables[y];
+	}
+	if (_insn->flags & VM_INSN_ZOOM_VAR) {
+		zoom = vmVariables[zoom];
+	}
+	res->_useSegVideo2 = (_insn->flags & VM_INSN_SEG_VIDEO2) != 0;
+
+	debug(DBG_VIDEO, "vid_opcd_0x40 : off=0x%X x=%d y=%d", off, x, y);
+	drawList->drawPolygon(res->_useSegVideo2 ? res->_segVideo2 : res->segCinematic, res->_useSegVideo2, off, 0xFF, zoom, x, y);
+}
+
+void VirtualMachine::op_invalid() {
+	error("VirtualMachine::executeThread() ec=0x%X invalid opcode=0x%X", 0xFFF, _insn->args[0]);
+}
+
 void VirtualMachine::executeThread() {
+#ifdef VM_THREADED_DISPATCH
+	executeThreadThreaded();
+#else
+	executeThreadTable();
+#endif
+}
 
-	while (!gotoNextThread) {
-		uint8_t opcode = _scriptPtr.fetchByte();
-
-		// 1000 0000 is set
-		if (opcode & 0x80) 
-		{
-			uint16_t off = ((opcode << 8) | _scriptPtr.fetchByte()) * 2;
-			res->_useSegVideo2 = false;
-			int16_t x = _scriptPtr.fetchByte();
-			int16_t y = _scriptPtr.fetchByte();
-			int16_t h = y - 199;
-			if (h > 0) {
-				y = 199;
-				x += h;
-			}
-			debug(DBG_VIDEO, "vid_opcd_0x80 : opcode=0x%X off=0x%X x=%d y=%d", opcode, off, x, y);
-
-			// This switch the polygon database to "cinematic" and probably draws a black polygon
-			// over all the screen.
-			video->setDataBuffer(res->segCinematic, off);
-			video->readAndDrawPolygon(COLOR_BLACK, DEFAULT_ZOOM, Point(x,y));
-
-			continue;
-		} 
-
-		// 0100 0000 is set
-		if (opcode & 0x40) 
-		{
-			int16_t x, y;
-			uint16_t off = _scriptPtr.fetchWord() * 2;
-			x = _scriptPtr.fetchByte();
-
-			res->_useSegVideo2 = false;
-
-			if (!(opcode & 0x20)) 
-			{
-				if (!(opcode & 0x10))  // 0001 0000 is set
-				{
-					x = (x << 8) | _scriptPtr.fetchByte();
-				} else {
-					x = vmVariables[x];
-				}
-			} 
-			else 
-			{
-				if (opcode & 0x10) { // 0001 0000 is set
-					x += 0x100;
-				}
-			}
+/*
+	Portable interpreter core: one indirect call through opcodeTable per instruction.
+	The decoder gave the 0x80/0x40 video families and invalid bytes their own
+	opcodes, so they go through the table like everything else.
+*/
+void VirtualMachine::executeThreadTable() {
 
-			y = _scriptPtr.fetchByte();
+	while (!gotoNextThread) {
+		_insn = &_instructions[_nextInsn];
+		_nextInsn = _insn->next;
+		(this->*opcodeTable[_insn->opcode])();
+	}
+}
 
-			if (!(opcode & 8))  // 0000 1000 is set
-			{
-				if (!(opcode & 4)) { // 0000 0100 is set
-					y = (y << 8) | _scriptPtr.fetchByte();
-				} else {
-					y = vmVariables[y];
-				}
-			}
+/*
+	Same loop as executeThreadTable, timing every handler for the profiler.
+*/
+void VirtualMachine::executeThreadProfiled(int threadId) {
 
-			uint16_t zoom = _scriptPtr.fetchByte();
-
-			if (!(opcode & 2))  // 0000 0010 is set
-			{
-				if (!(opcode & 1)) // 0000 0001 is set
-				{
-					--_scriptPtr.pc;
-					zoom = 0x40;
-				} 
-				else 
-				{
-					zoom = vmVariables[zoom];
-				}
-			} 
-			else 
-			{
-				
-				if (opcode & 1) { // 0000 0001 is set
-					res->_useSegVideo2 = true;
-					--_scriptPtr.pc;
-					zoom = 0x40;
-				}
-			}
-			debug(DBG_VIDEO, "vid_opcd_0x40 : off=0x%X x=%d y=%d", off, x, y);
-			video->setDataBuffer(res->_useSegVideo2 ? res->_segVideo2 : res->segCinematic, off);
-			video->readAndDrawPolygon(0xFF, zoom, Point(x, y));
-
-			continue;
-		} 
-		 
-		
-		if (opcode > 0x1A) 
-		{
-			error("VirtualMachine::executeThread() ec=0x%X invalid opcode=0x%X", 0xFFF, opcode);
-		} 
-		else 
-		{
-			(this->*opcodeTable[opcode])();
-		}
-		
+	uint32_t instructions = 0;
+	uint64_t start = VMProfiler::getTicks();
+	uint64_t t0 = start;
+	while (!gotoNextThread) {
+		_insn = &_instructions[_nextInsn];
+		_nextInsn = _insn->next;
+		uint8_t opcode = _insn->opcode;
+		(this->*opcodeTable[opcode])();
+		uint64_t t1 = VMProfiler::getTicks();
+		_profiler->countOpcode(opcode, t1 - t0);
+		t0 = t1;
+		++instructions;
 	}
+	_profiler->countSlice(threadId, instructions, t0 - start);
+}
+
+#ifdef VM_THREADED_DISPATCH
+/*
+	Same interpreter built on labels-as-values: every handler ends with its own copy
+	of the dispatch jump, and the op_* calls are direct so the compiler can inline
+	them. op_pauseThread and op_killThread are the only opcodes setting
+	gotoNextThread, so they are the only ones returning.
+*/
+void VirtualMachine::executeThreadThreaded() {
+
+	static const void *const dispatchTable[] = {
+		/* 0x00 */
+		&&l_movConst, &&l_mov, &&l_add, &&l_addConst,
+		/* 0x04 */
+		&&l_call, &&l_ret, &&l_pauseThread, &&l_jmp,
+		/* 0x08 */
+		&&l_setSetVect, &&l_jnz, &&l_condJmp, &&l_setPalette,
+		/* 0x0C */
+		&&l_resetThread, &&l_selectVideoPage, &&l_fillVideoPage, &&l_copyVideoPage,
+		/* 0x10 */
+		&&l_blitFramebuffer, &&l_killThread, &&l_drawString, &&l_sub,
+		/* 0x14 */
+		&&l_and, &&l_or, &&l_shl, &&l_shr,
+		/* 0x18 */
+		&&l_playSound, &&l_updateMemList, &&l_playMusic,
+		/* VM_OPCODE_VIDEO_CINEMATIC, VM_OPCODE_VIDEO_POLYGON, VM_OPCODE_INVALID */
+		&&l_drawCinematicPolygon, &&l_drawPolygon, &&l_invalid
+	};
+
+#define VM_DISPATCH() \
+	do { \
+		_insn = &_instructions[_nextInsn]; \
+		_nextInsn = _insn->next; \
+		goto *dispatchTable[_insn->opcode]; \
+	} while (0)
+
+	if (gotoNextThread)
+		return;
+
+	VM_DISPATCH();
+
+l_movConst:             op_movConst();             VM_DISPATCH();
+l_mov:                  op_mov();                  VM_DISPATCH();
+l_add:                  op_add();                  VM_DISPATCH();
+l_addConst:             op_addConst();             VM_DISPATCH();
+l_call:                 op_call();                 VM_DISPATCH();
+l_ret:                  op_ret();                  VM_DISPATCH();
+l_pauseThread:          op_pauseThread();          return;
+l_jmp:                  op_jmp();                  VM_DISPATCH();
+l_setSetVect:           op_setSetVect();           VM_DISPATCH();
+l_jnz:                  op_jnz();                  VM_DISPATCH();
+l_condJmp:              op_condJmp();              VM_DISPATCH();
+l_setPalette:           op_setPalette();           VM_DISPATCH();
+l_resetThread:          op_resetThread();          VM_DISPATCH();
+l_selectVideoPage:      op_selectVideoPage();      VM_DISPATCH();
+l_fillVideoPage:        op_fillVideoPage();        VM_DISPATCH();
+l_copyVideoPage:        op_copyVideoPage();        VM_DISPATCH();
+l_blitFramebuffer:      op_blitFramebuffer();      VM_DISPATCH();
+l_killThread:           op_killThread();           return;
+l_drawString:           op_drawString();           VM_DISPATCH();
+l_sub:                  op_sub();                  VM_DISPATCH();
+l_and:                  op_and();                  VM_DISPATCH();
+l_or:                   op_or();                   VM_DISPATCH();
+l_shl:                  op_shl();                  VM_DISPATCH();
+l_shr:                  op_shr();                  VM_DISPATCH();
+l_playSound:            op_playSound();            VM_DISPATCH();
+l_updateMemList:        op_updateMemList();        VM_DISPATCH();
+l_playMusic:            op_playMusic();            VM_DISPATCH();
+l_drawCinematicPolygon: op_drawCinematicPolygon(); VM_DISPATCH();
+l_drawPolygon:          op_drawPolygon();          VM_DISPATCH();
+l_invalid:              op_invalid();              return;
+
+#undef VM_DISPATCH
 }
+#endif
 
 void VirtualMachine::inp_updatePlayer() {
 
@@ -715,4 +845,7 @@ void VirtualMachine::saveOrLoad(Serializer &ser) {
 		SE_END()
 	};
 	ser.saveOrLoadEntries(entries);
+	if (ser._mode == Serializer::SM_LOAD) {
+		rebuildThreadMasks();
+	}
 }
@@ -21,11 +21,19 @@
 
 #include "intern.h"
 
+// Computed-goto dispatch relies on the labels-as-values extension of GCC and Clang.
+#if defined(VM_THREADED_DISPATCH) && !defined(__GNUC__)
+#undef VM_THREADED_DISPATCH
+#endif
+
 #define VM_NUM_THREADS 64
 #define VM_NUM_VARIABLES 256
 #define VM_NO_SETVEC_REQUESTED 0xFFFF
 #define VM_INACTIVE_THREAD    0xFFFF
 
+// Bytecode offsets are 16 bits, so a part can never hold more instructions than this.
+#define VM_MAX_INSTRUCTIONS 0x10000
+
 
 enum ScriptVars {
 		VM_VARIABLE_RANDOM_SEED          = 0x3C,
@@ -50,7 +58,37 @@ struct Resource;
 struct Serializer;
 struct SfxPlayer;
 struct System;
-struct Video;
+struct DrawList;
+struct VMProfiler;
+
+/*
+	A bytecode instruction translated once per part (see vmdecoder.cpp). Operands are
+	already fetched in host endianness and jump targets point straight into the
+	decoded array, so the interpreter never touches segBytecode while running.
+
+	args[] contents depend on the opcode, in the order the original fetch*() calls
+	read them. The two video families get their own opcodes:
+*/
+enum {
+	VM_OPCODE_VIDEO_CINEMATIC = 0x1B, // opcode & 0x80: args = off, x, y
+	VM_OPCODE_VIDEO_POLYGON   = 0x1C, // opcode & 0x40: args = off, x, y, zoom + VM_INSN_* flags
+	VM_OPCODE_INVALID         = 0x1D  // args[0] = the offending byte
+};
+
+// Flags of VM_OPCODE_VIDEO_POLYGON: where x, y and zoom come from.
+#define VM_INSN_X_VAR        (1 << 0)
+#define VM_INSN_Y_VAR        (1 << 1)
+#define VM_INSN_ZOOM_VAR     (1 << 2)
+#define VM_INSN_SEG_VIDEO2   (1 << 3)
+
+struct VMInstruction {
+	uint8_t opcode;
+	uint8_t flags;    // VM_INSN_* for video opcodes, the condition byte for op_condJmp
+	uint16_t pc;      // offset of the opcode byte in segBytecode
+	uint16_t next;    // index of the instruction following this one
+	uint16_t target;  // index of the jump/call destination
+	int16_t args[4];
+};
 
 //For threadsData navigation
 #define PC_OFFSET 0
@@ -74,8 +112,9 @@ struct VirtualMachine {
 	Mixer *mixer;
 	Resource *res;
 	SfxPlayer *player;
-	Video *video;
+	DrawList *drawList;
 	System *sys;
+	VMProfiler *_profiler;
 
 	int16_t vmVariables[VM_NUM_VARIABLES];
 	uint16_t _scriptStackCalls[VM_NUM_THREADS];
@@ -87,11 +126,32 @@ struct VirtualMachine {
 	//     1 When a setVec is requested for the next vm frame.
 	uint8_t vmIsChannelActive[NUM_THREAD_FIELDS][VM_NUM_THREADS];
 
-	Ptr _scriptPtr;
+	// One bit per thread, mirroring the two arrays above so the scheduler only
+	// visits the threads that matter. Kept in sync by the opcodes touching
+	// them, rebuilt with rebuildThreadMasks() when the arrays are reset or loaded.
+	uint64_t _activeThreadsMask;          // threadsData[PC_OFFSET] != VM_INACTIVE_THREAD
+	uint64_t _pausedThreadsMask;          // vmIsChannelActive[CURR_STATE] != 0
+	uint64_t _requestedPausedThreadsMask; // vmIsChannelActive[REQUESTED_STATE] != 0
+	uint64_t _setVecThreadsMask;          // threadsData[REQUESTED_PC_OFFSET] written since the last frame
+
 	uint8_t _stackPtr;
 	bool gotoNextThread;
 
-	VirtualMachine(Mixer *mix, Resource *res, SfxPlayer *ply, Video *vid, System *stub);
+	// When the last frame was presented, op_blitFramebuffer paces the game from it.
+	uint32_t _lastTimeStamp;
+
+	// Decoded form of res->segBytecode. Entry 0 is a sentinel standing for pc 0xFFFF
+	// (VM_INACTIVE_THREAD), _pcToInstruction[pc] == 0 means "not decoded yet".
+	VMInstruction _instructions[VM_MAX_INSTRUCTIONS];
+	uint16_t _pcToInstruction[VM_MAX_INSTRUCTIONS];
+	uint16_t _translateStack[VM_MAX_INSTRUCTIONS];
+	uint32_t _numInstructions;
+
+	// Instruction being executed and index of the one to execute next.
+	const VMInstruction *_insn;
+	uint16_t _nextInsn;
+
+	VirtualMachine(Mixer *mix, Resource *res, SfxPlayer *ply, DrawList *draw, System *stub);
 	void init();
 	
 	void op_movConst();
@@ -121,11 +181,25 @@ struct VirtualMachine {
 	void op_playSound();
 	void op_updateMemList();
 	void op_playMusic();
+	void op_drawCinematicPolygon();
+	void op_drawPolygon();
+	void op_invalid();
+
+	void resetInstructionCache();
+	uint16_t translate(uint16_t pc);
+	void decodeInstruction(uint16_t pc, VMInstruction *insn);
 
+	void rebuildThreadMasks();
 	void initForPart(uint16_t partId);
+	uint16_t predictNextPart();
 	void checkThreadRequests();
 	void hostFrame();
 	void executeThread();
+	void executeThreadTable();
+	void executeThreadProfiled(int threadId);
+#ifdef VM_THREADED_DISPATCH
+	void executeThreadThreaded();
+#endif
 
 	void inp_updatePlayer();
 	void inp_handleSpecialKeys();
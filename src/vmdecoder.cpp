@@ -0,0 +1,273 @@
+/* Raw - Another World Interpreter
+ * Copyright (C) 2004 Gregory Montoir
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "vm.h"
+#include "resource.h"
+
+
+/*
+	Forget everything decoded for the previous segBytecode and translate the new one,
+	starting from the entry point of thread 0. Every other thread is started by a
+	setvec whose destination is a constant, so following jumps, calls and setvecs
+	reaches all the code the part can run.
+*/
+void VirtualMachine::resetInstructionCache() {
+
+	memset(_pcToInstruction, 0, sizeof(_pcToInstruction));
+
+	VMInstruction *sentinel = &_instructions[0];
+	memset(sentinel, 0, sizeof(VMInstruction));
+	sentinel->opcode = VM_OPCODE_INVALID;
+	sentinel->pc = VM_INACTIVE_THREAD;
+	sentinel->args[0] = 0xFF;
+	_numInstructions = 1;
+
+	translate(0);
+
+	debug(DBG_VM, "VirtualMachine::resetInstructionCache() %d instructions decoded", _numInstructions - 1);
+}
+
+/*
+	Return the index of the instruction at pc, decoding it (and everything reachable
+	from it) if needed. This only does work at part load, or when a saved game
+	resumes a thread somewhere the static walk did not reach.
+*/
+uint16_t VirtualMachine::translate(uint16_t startPc) {
+
+	if (startPc == VM_INACTIVE_THREAD || _pcToInstruction[startPc] != 0)
+		return _pcToInstruction[startPc];
+
+	uint32_t firstNew = _numInstructions;
+	uint32_t sp = 0;
+	_translateStack[sp++] = startPc;
+
+	while (sp != 0) {
+		uint16_t pc = _translateStack[--sp];
+
+		// Follow straight-line code until it joins something already decoded.
+		while (pc != VM_INACTIVE_THREAD && _pcToInstruction[pc] == 0) {
+			assert(_numInstructions < VM_MAX_INSTRUCTIONS);
+			VMInstruction *insn = &_instructions[_numInstructions];
+			decodeInstruction(pc, insn);
+			_pcToInstruction[pc] = _numInstructions++;
+
+			uint16_t other = insn->target;
+			if (insn->opcode == 0x08) {
+				other = insn->args[1];
+			}
+			if (other < 0xFFFE && _pcToInstruction[other] == 0) {
+				assert(sp < VM_MAX_INSTRUCTIONS);
+				_translateStack[sp++] = other;
+			}
+			pc = insn->next;
+		}
+	}
+
+	// decodeInstruction() left bytecode offsets in next/target, now that every
+	// destination has been decoded turn them into indices.
+	for (uint32_t i = firstNew; i < _numInstructions; ++i) {
+		VMInstruction *insn = &_instructions[i];
+		insn->next = _pcToInstruction[insn->next];
+		insn->target = _pcToInstruction[insn->target];
+	}
+
+	return _pcToInstruction[startPc];
+}
+
+/*
+	Decode the instruction at pc exactly the way the op_* handlers used to fetch it.
+	next/target receive bytecode offsets, VM_INACTIVE_THREAD when there is none.
+*/
+void VirtualMachine::decodeInstruction(uint16_t pc, VMInstruction *insn) {
+
+	Ptr p;
+	p.pc = res->segBytecode + pc;
+
+	memset(insn, 0, sizeof(VMInstruction));
+	insn->pc = pc;
+	insn->target = VM_INACTIVE_THREAD;
+
+	uint8_t opcode = p.fetchByte();
+	bool fallsThrough = true;
+
+	if (opcode & 0x80) {
+		insn->opcode = VM_OPCODE_VIDEO_CINEMATIC;
+		uint16_t off = ((opcode << 8) | p.fetchByte()) * 2;
+		int16_t x = p.fetchByte();
+		int16_t y = p.fetchByte();
+		int16_t h = y - 199;
+		if (h > 0) {
+			y = 199;
+			x += h;
+		}
+		insn->args[0] = off;
+		insn->args[1] = x;
+		insn->args[2] = y;
+	} else if (opcode & 0x40) {
+		insn->opcode = VM_OPCODE_VIDEO_POLYGON;
+		int16_t x, y;
+		uint16_t off = p.fetchWord() * 2;
+		x = p.fetchByte();
+
+		if (!(opcode & 0x20)) {
+			if (!(opcode & 0x10)) {
+				x = (x << 8) | p.fetchByte();
+			} else {
+				insn->flags |= VM_INSN_X_VAR;
+			}
+		} else {
+			if (opcode & 0x10) {
+				x += 0x100;
+			}
+		}
+
+		y = p.fetchByte();
+
+		if (!(opcode & 8)) {
+			if (!(opcode & 4)) {
+				y = (y << 8) | p.fetchByte();
+			} else {
+				insn->flags |= VM_INSN_Y_VAR;
+			}
+		}
+
+		uint16_t zoom = p.fetchByte();
+
+		if (!(opcode & 2)) {
+			if (!(opcode & 1)) {
+				--p.pc;
+				zoom = 0x40;
+			} else {
+				insn->flags |= VM_INSN_ZOOM_VAR;
+			}
+		} else {
+			if (opcode & 1) {
+				insn->flags |= VM_INSN_SEG_VIDEO2;
+				--p.pc;
+				zoom = 0x40;
+			}
+		}
+		insn->args[0] = off;
+		insn->args[1] = x;
+		insn->args[2] = y;
+		insn->args[3] = zoom;
+	} else {
+		insn->opcode = opcode;
+		switch (opcode) {
+		case 0x00: // op_movConst
+		case 0x03: // op_addConst
+		case 0x14: // op_and
+		case 0x15: // op_or
+		case 0x16: // op_shl
+		case 0x17: // op_shr
+			insn->args[0] = p.fetchByte();
+			insn->args[1] = p.fetchWord();
+			break;
+		case 0x01: // op_mov
+		case 0x02: // op_add
+		case 0x0E: // op_fillVideoPage
+		case 0x0F: // op_copyVideoPage
+		case 0x13: // op_sub
+			insn->args[0] = p.fetchByte();
+			insn->args[1] = p.fetchByte();
+			break;
+		case 0x04: // op_call
+			insn->target = p.fetchWord();
+			break;
+		case 0x05: // op_ret
+			fallsThrough = false;
+			break;
+		case 0x06: // op_pauseThread
+			break;
+		case 0x07: // op_jmp
+			insn->target = p.fetchWord();
+			fallsThrough = false;
+			break;
+		case 0x08: // op_setSetVect
+			insn->args[0] = p.fetchByte();
+			insn->args[1] = p.fetchWord();
+			break;
+		case 0x09: // op_jnz
+			insn->args[0] = p.fetchByte();
+			insn->target = p.fetchWord();
+			break;
+		case 0x0A: { // op_condJmp
+			uint8_t condition = p.fetchByte();
+			insn->flags = condition;
+			insn->args[0] = p.fetchByte();
+			if (condition & 0x80) {
+				insn->args[1] = p.fetchByte();
+			} else if (condition & 0x40) {
+				insn->args[1] = p.fetchWord();
+			} else {
+				insn->args[1] = p.fetchByte();
+			}
+			insn->target = p.fetchWord();
+			}
+			break;
+		case 0x0B: // op_setPalette
+		case 0x19: // op_updateMemList
+			insn->args[0] = p.fetchWord();
+			break;
+		case 0x0C: { // op_resetThread
+			uint8_t threadId = p.fetchByte();
+			uint8_t i = p.fetchByte();
+			insn->args[0] = threadId;
+			insn->args[1] = i;
+			// When the range is invalid the handler bails out before reading its
+			// third operand, which then gets executed as the next opcode.
+			int8_t n = (i & (VM_NUM_THREADS - 1)) - threadId;
+			if (n >= 0) {
+				insn->args[2] = p.fetchByte();
+			}
+			}
+			break;
+		case 0x0D: // op_selectVideoPage
+		case 0x10: // op_blitFramebuffer
+			insn->args[0] = p.fetchByte();
+			break;
+		case 0x11: // op_killThread
+			fallsThrough = false;
+			break;
+		case 0x12: // op_drawString
+			insn->args[0] = p.fetchWord();
+			insn->args[1] = p.fetchByte();
+			insn->args[2] = p.fetchByte();
+			insn->args[3] = p.fetchByte();
+			break;
+		case 0x18: // op_playSound
+			insn->args[0] = p.fetchWord();
+			insn->args[1] = p.fetchByte();
+			insn->args[2] = p.fetchByte();
+			insn->args[3] = p.fetchByte();
+			break;
+		case 0x1A: // op_playMusic
+			insn->args[0] = p.fetchWord();
+			insn->args[1] = p.fetchWord();
+			insn->args[2] = p.fetchByte();
+			break;
+		default:
+			insn->opcode = VM_OPCODE_INVALID;
+			insn->args[0] = opcode;
+			fallsThrough = false;
+			break;
+		}
+	}
+
+	insn->next = fallsThrough ? (uint16_t)(p.pc - res->segBytecode) : VM_INACTIVE_THREAD;
+}